@@ -0,0 +1,377 @@
+/* Parser microbenchmarks
+ *
+ * Generates synthetic option specs of several sizes and argument workloads,
+ * and reports time per argument, allocations and cache misses per operation
+ * for parsing, help rendering and error reporting.
+ *
+ * Usage: optparse_bench [min-seconds-per-case]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "optparse.h"
+
+#define MAX_SPEC 1000
+#define MAX_ARGV 2048
+#define NAME_LEN 16
+
+/* Synthetic option spec
+ *
+ * Every tenth option is a positional, the others alternate between flags and
+ * int options. Flags get short names while there are short names left.
+ */
+typedef struct {
+  Option opts[MAX_SPEC];
+  char names[MAX_SPEC][NAME_LEN];
+  long values[MAX_SPEC];
+  OptionList list;
+  OptParser parser;
+  uint64_t parser_data[8192];
+  OptIndex index;
+  OptIndexSlot slots[2 * 1024];
+  size_t n_opts;
+} Spec;
+
+typedef struct {
+  char* argv[MAX_ARGV];
+  char storage[MAX_ARGV][NAME_LEN + 2];
+  int argc;
+  /* arguments excluding the program name */
+  int n_args;
+} Workload;
+
+typedef enum {
+  WORKLOAD_LONG,
+  WORKLOAD_SHORT_GROUPS,
+  WORKLOAD_POSITIONALS,
+} WorkloadType;
+
+typedef struct {
+  double ns;
+  double allocs;
+  double cache_misses;
+} Measurement;
+
+typedef void (*BenchFn)(Spec* spec, Workload* wl);
+
+/* Build a spec with `n` options */
+static void spec_init(Spec* spec, size_t n);
+
+/* Build an argument vector of the given type for a spec */
+static void workload_init(Workload* wl, Spec const* spec, WorkloadType type);
+
+/* Run `fn` repeatedly for at least `min_seconds` */
+static Measurement measure(BenchFn fn, Spec* spec, Workload* wl, double min_seconds);
+
+static void report(char const* name, size_t n_opts, char const* workload, int n_args, Measurement m);
+
+/* Compile the spec, with or without the long option index */
+static void spec_compile(Spec* spec, bool indexed);
+
+static void bench_parse_opts(Spec* spec, Workload* wl);
+static void bench_parse_compiled(Spec* spec, Workload* wl);
+static void bench_print_help(Spec* spec, Workload* wl);
+static void bench_error(Spec* spec, Workload* wl);
+
+static double now_ns(void);
+
+static int cache_misses_open(void);
+static long long cache_misses_read(int fd);
+
+static FILE* devnull;
+static size_t alloc_count;
+
+static char const short_names[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+/* argv elements are not const */
+static char arg_progname[] = "bench";
+static char arg_int[] = "12345";
+static char arg_positional[] = "positional";
+static char arg_unknown[] = "--no-such-option";
+
+int main(int argc, char** argv) {
+  double const min_seconds = argc > 1 ? atof(argv[1]) : 0.2;
+
+  devnull = fopen("/dev/null", "w");
+  if (!devnull) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  static Spec spec;
+  static Workload wl;
+  size_t const sizes[] = {10, 100, 1000};
+  struct {
+    WorkloadType type;
+    char const* name;
+  } const workloads[] = {
+      {WORKLOAD_LONG, "long"},
+      {WORKLOAD_SHORT_GROUPS, "short-groups"},
+      {WORKLOAD_POSITIONALS, "positionals"},
+  };
+
+  printf("%-16s %6s %-14s %6s %12s %10s %12s\n", "case", "opts", "workload", "args", "ns/arg", "allocs/op",
+         "misses/op");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+    spec_init(&spec, sizes[s]);
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(*workloads); ++w) {
+      workload_init(&wl, &spec, workloads[w].type);
+      char const* name = workloads[w].name;
+      spec.list.index = NULL;
+      report("parse_opts", spec.n_opts, name, wl.n_args, measure(bench_parse_opts, &spec, &wl, min_seconds));
+      spec_compile(&spec, false);
+      report("optparser_parse", spec.n_opts, name, wl.n_args, measure(bench_parse_compiled, &spec, &wl, min_seconds));
+      spec_compile(&spec, true);
+      report("indexed_parse", spec.n_opts, name, wl.n_args, measure(bench_parse_compiled, &spec, &wl, min_seconds));
+    }
+
+    spec.list.index = NULL;
+
+    workload_init(&wl, &spec, WORKLOAD_LONG);
+    report("print_help", spec.n_opts, "-", 1, measure(bench_print_help, &spec, &wl, min_seconds));
+    report("error", spec.n_opts, "long", wl.n_args, measure(bench_error, &spec, &wl, min_seconds));
+  }
+
+  fclose(devnull);
+  return 0;
+}
+
+#if defined(OPTBENCH_COUNT_ALLOCS)
+/* Allocation counters, the functions are wrapped by the linker */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t n, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  alloc_count += 1;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  alloc_count += 1;
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  alloc_count += 1;
+  return __real_realloc(ptr, size);
+}
+#endif
+
+static void spec_init(Spec* spec, size_t n) {
+  size_t n_short = 0;
+  spec->n_opts = n;
+
+  for (size_t i = 0; i < n; ++i) {
+    Option* opt = &spec->opts[i];
+    snprintf(spec->names[i], NAME_LEN, "opt-%u", (unsigned)(i % MAX_SPEC));
+    *opt = (Option){.lname = spec->names[i], .dest = &spec->values[i]};
+    if (i % 10 == 9) {
+      opt->type = OPTION_POSITIONAL;
+    } else if (i % 2 == 0) {
+      opt->type = OPTION_FLAG;
+      if (n_short < sizeof(short_names) - 1)
+        opt->sname = short_names[n_short++];
+    } else {
+      opt->type = OPTION_STORE_INT;
+      opt->metavar = "N";
+    }
+    opt->help = "synthetic option";
+
+    if (i == 0) {
+      OPTLIST_INIT(spec->list, *opt);
+    } else {
+      OPTLIST_ADD(spec->list, *opt);
+    }
+  }
+}
+
+static void workload_init(Workload* wl, Spec const* spec, WorkloadType type) {
+  wl->argc = 0;
+  wl->argv[wl->argc++] = arg_progname;
+
+  /* positionals are required in every workload */
+  size_t n_pos = 0;
+  for (size_t i = 0; i < spec->n_opts; ++i)
+    n_pos += spec->opts[i].type == OPTION_POSITIONAL;
+
+  switch (type) {
+  case WORKLOAD_LONG:
+    /* the option counts are coprime with 7, so every option is visited */
+    for (size_t i = 0; wl->argc < 1000 - (int)n_pos; i = (i + 7) % spec->n_opts) {
+      Option const* opt = &spec->opts[i];
+      if (opt->type == OPTION_POSITIONAL)
+        continue;
+      char* buf = wl->storage[wl->argc];
+      snprintf(buf, NAME_LEN + 2, "--%s", opt->lname);
+      wl->argv[wl->argc++] = buf;
+      if (opt->type == OPTION_STORE_INT)
+        wl->argv[wl->argc++] = arg_int;
+    }
+    break;
+
+  case WORKLOAD_SHORT_GROUPS: {
+    /* fill storage rows with groups of every short name, repeated */
+    size_t n_short = 0;
+    for (size_t i = 0; i < spec->n_opts; ++i)
+      n_short += spec->opts[i].sname != 0;
+    for (int g = 0; g < 64; ++g) {
+      char* buf = wl->storage[wl->argc];
+      buf[0] = '-';
+      size_t len = 1;
+      for (size_t i = 0; len < NAME_LEN + 1; ++i)
+        buf[len++] = short_names[(i + (size_t)g) % n_short];
+      buf[len] = '\0';
+      wl->argv[wl->argc++] = buf;
+    }
+    break;
+  }
+
+  case WORKLOAD_POSITIONALS:
+    break;
+  }
+
+  for (size_t i = 0; i < n_pos; ++i)
+    wl->argv[wl->argc++] = arg_positional;
+
+  wl->n_args = wl->argc - 1;
+}
+
+static Measurement measure(BenchFn fn, Spec* spec, Workload* wl, double min_seconds) {
+  int const fd = cache_misses_open();
+
+  /* warm up */
+  fn(spec, wl);
+
+  size_t iterations = 0;
+  size_t const allocs_start = alloc_count;
+  long long const misses_start = cache_misses_read(fd);
+  double const start = now_ns();
+  double elapsed = 0;
+  do {
+    for (int i = 0; i < 16; ++i)
+      fn(spec, wl);
+    iterations += 16;
+    elapsed = now_ns() - start;
+  } while (elapsed < min_seconds * 1e9);
+  long long const misses_end = cache_misses_read(fd);
+
+#if defined(__linux__)
+  if (fd != -1)
+    close(fd);
+#endif
+
+  return (Measurement){
+      .ns = elapsed / (double)iterations,
+      .allocs = (double)(alloc_count - allocs_start) / (double)iterations,
+      .cache_misses = fd == -1 ? -1 : (double)(misses_end - misses_start) / (double)iterations,
+  };
+}
+
+static void report(char const* name, size_t n_opts, char const* workload, int n_args, Measurement m) {
+  printf("%-16s %6zu %-14s %6d %12.1f", name, n_opts, workload, n_args, m.ns / (n_args > 0 ? n_args : 1));
+#if defined(OPTBENCH_COUNT_ALLOCS)
+  printf(" %10.2f", m.allocs);
+#else
+  printf(" %10s", "n/a");
+#endif
+  if (m.cache_misses < 0)
+    printf(" %12s\n", "n/a");
+  else
+    printf(" %12.1f\n", m.cache_misses);
+}
+
+static void bench_parse_opts(Spec* spec, Workload* wl) {
+  OptParserError err = {0};
+  if (parse_opts(&spec->list, wl->argc, wl->argv, &err) == -1) {
+    print_error(&err, stderr);
+    exit(1);
+  }
+}
+
+static void spec_compile(Spec* spec, bool indexed) {
+  spec->list.index = NULL;
+  if (indexed) {
+    optindex_build(&spec->index, &spec->list, spec->slots, sizeof(spec->slots) / sizeof(*spec->slots));
+    spec->list.index = &spec->index;
+  }
+  if (optparser_compile(&spec->parser, &spec->list, spec->parser_data, sizeof(spec->parser_data)) != 0) {
+    fprintf(stderr, "cannot compile the spec\n");
+    exit(1);
+  }
+}
+
+static void bench_parse_compiled(Spec* spec, Workload* wl) {
+  static OptParseState state;
+  OptParserError err = {0};
+  if (optparser_parse(&spec->parser, &state, wl->argc, wl->argv, &err) == -1) {
+    print_error(&err, stderr);
+    exit(1);
+  }
+}
+
+static void bench_print_help(Spec* spec, Workload* wl) {
+  (void)wl;
+  print_usage(&spec->list, devnull, "bench");
+  print_help(&spec->list, devnull);
+}
+
+static void bench_error(Spec* spec, Workload* wl) {
+  char* const last = wl->argv[wl->argc - 1];
+  wl->argv[wl->argc - 1] = arg_unknown;
+  OptParserError err = {0};
+  if (parse_opts(&spec->list, wl->argc, wl->argv, &err) == 0)
+    exit(1);
+  print_error(&err, devnull);
+  print_usage(&spec->list, devnull, "bench");
+  wl->argv[wl->argc - 1] = last;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int cache_misses_open(void) {
+#if defined(__linux__)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static long long cache_misses_read(int fd) {
+  long long count = 0;
+#if defined(__linux__)
+  if (fd != -1 && read(fd, &count, sizeof(count)) != sizeof(count))
+    count = 0;
+#else
+  (void)fd;
+#endif
+  return count;
+}
@@ -0,0 +1,27 @@
+# Train the optparse library profile, see OPTPARSE_PGO
+#
+# Runs the instrumented benchmark BENCH, which writes its profile into
+# PGO_DIR/data, merges the profile with LLVM_PROFDATA if it is set, for Clang,
+# and removes the library objects OBJECTS, so they are rebuilt with it.
+
+# GCC adds every run to the profile of the previous ones
+file(REMOVE_RECURSE ${PGO_DIR}/data)
+file(MAKE_DIRECTORY ${PGO_DIR}/data)
+
+# a short run of every case is enough for branch and call counts
+execute_process(COMMAND ${BENCH} 0.01 OUTPUT_QUIET RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${BENCH} failed: ${result}")
+endif()
+
+if (LLVM_PROFDATA)
+    file(GLOB raw_profiles ${PGO_DIR}/data/*.profraw)
+    execute_process(COMMAND ${LLVM_PROFDATA} merge -output=${PGO_DIR}/optparse.profdata ${raw_profiles}
+        RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "${LLVM_PROFDATA} failed: ${result}")
+    endif()
+endif()
+
+file(REMOVE ${OBJECTS})
+file(TOUCH ${PGO_DIR}/profile.stamp)
@@ -1,94 +1,77 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "optparse.h"
 
+typedef struct {
+  bool foo;
+  bool bar;
+  bool help;
+  int verbose;
+  char const* str;
+  long long_val;
+  char const* path;
+  char const* config;
+} Args;
+
+#define CLI_OPTIONS(OPT, POS)                                                                                          \
+  OPT(CLI_FOO, 'f', false, NULL, .lname = "foo", .type = OPTION_FLAG, .offset = offsetof(Args, foo),                   \
+      .help = "foo option")                                                                                            \
+  OPT(CLI_BAR, 'b', false, NULL, .lname = "bar", .type = OPTION_FLAG, .offset = offsetof(Args, bar),                   \
+      .help = "bar option")                                                                                            \
+  OPT(CLI_HELP, 'h', false, NULL, .lname = "help", .type = OPTION_FLAG, .offset = offsetof(Args, help),                \
+      .help = "show help message")                                                                                     \
+  POS(CLI_PATH, .lname = "path", .offset = offsetof(Args, path), .help = "a path")                                     \
+  OPT(CLI_STR, 's', true, "CLI_STR", .lname = "str", .metavar = "STR", .type = OPTION_STORE_STR,                       \
+      .offset = offsetof(Args, str), .help = "string option")                                                          \
+  OPT(CLI_VERBOSE, 'v', false, NULL, .lname = "verbose", .type = OPTION_INCREMENT, .offset = offsetof(Args, verbose),  \
+      .help = "verbosity level")                                                                                       \
+  OPT(CLI_INT, 'i', true, NULL, .lname = "int", .type = OPTION_STORE_INT, .offset = offsetof(Args, long_val),          \
+      .help = "int option")                                                                                            \
+  OPT(CLI_CONFIG, 0, false, NULL, .lname = "config", .metavar = "PATH", .type = OPTION_CONFIG,                         \
+      .offset = offsetof(Args, config), .help = "config file")
+
+#define OPTSPEC_NAME cli_parser
+#define OPTSPEC_LIST CLI_OPTIONS
+#define OPTSPEC_FLAGS (OPTPARSER_RESPONSE_FILES | OPTPARSER_ABBREVIATIONS)
+#define OPTSPEC_CONFIG CLI_CONFIG
+#include "optspec.h"
+
+/* usage and help are rendered into the cache only when both are printed; if
+ * they do not fit, they are printed without it. The usage of an error is
+ * printed once, so it is rendered straight to stderr */
+static char help_text[1024];
+
 int main(int argc, char** argv) {
-  bool foo = false;
-  bool bar = false;
-  bool help = false;
-  int verbose = 0;
-  char const* str = NULL;
-  long long_val = 0;
-  char const* path = NULL;
+  if (optparser_complete(&cli_parser, NULL, 0, argc, argv, stdout))
+    return 0;
 
-  Option foo_opt = {
-      .lname = "foo",
-      .sname = 'f',
-      .type = OPTION_FLAG,
-      .dest = &foo,
-      .help = "foo option",
-  };
-  Option bar_opt = {
-      .lname = "bar",
-      .sname = 'b',
-      .type = OPTION_FLAG,
-      .dest = &bar,
-      .help = "bar option",
-  };
-  Option help_opt = {
-      .lname = "help",
-      .sname = 'h',
-      .type = OPTION_FLAG,
-      .dest = &help,
-      .help = "show help message",
-  };
-  Option path_opt = {
-      .lname = "path",
-      .type = OPTION_POSITIONAL,
-      .dest = &path,
-      .help = "a path",
-  };
-  Option str_opt = {
-      .lname = "str",
-      .sname = 's',
-      .metavar = "STR",
-      .type = OPTION_STORE_STR,
-      .required = true,
-      .dest = &str,
-      .help = "string option",
-  };
-  Option int_opt = {
-      .lname = "int",
-      .sname = 'i',
-      .type = OPTION_STORE_INT,
-      .required = true,
-      .dest = &long_val,
-      .help = "int option",
-  };
-  Option verbose_opt = {
-      .lname = "verbose",
-      .sname = 'v',
-      .type = OPTION_INCREMENT,
-      .dest = &verbose,
-      .help = "verbosity level",
-  };
+  Args args = {0};
 
-  OptionList opts;
-  OPTLIST_INIT(opts, foo_opt);
-  OPTLIST_ADD(opts, bar_opt);
-  OPTLIST_ADD(opts, help_opt);
-  OPTLIST_ADD(opts, path_opt);
-  OPTLIST_ADD(opts, str_opt);
-  OPTLIST_ADD(opts, verbose_opt);
-  OPTLIST_ADD(opts, int_opt);
+  OptParseState state;
+  optparse_state_init(&state, &args);
 
   OptParserError err = {0};
-  if (parse_opts(&opts, argc, argv, &err) == -1 && !help) {
+  if (optparser_parse(&cli_parser, &state, argc, argv, &err) == -1 && !args.help) {
     print_error(&err, stderr);
-    print_usage(&opts, stderr, argv[0]);
+    optparser_print_usage(&cli_parser, stderr, argv[0]);
     return 64;
   }
 
-  if (help) {
-    print_usage(&opts, stdout, argv[0]);
-    print_help(&opts, stdout);
+  if (args.help) {
+    opthelp_build(&cli_parser_help, &cli_parser, help_text, sizeof(help_text));
+    optparser_print_usage(&cli_parser, stdout, argv[0]);
+    optparser_print_help(&cli_parser, stdout);
+    optparse_state_release(&state);
     return 0;
   }
 
-  printf("foo=%i bar=%i verbose=%i path=%s str=%s int=%li\n", foo, bar, verbose, path, str, long_val);
+  printf("foo=%i bar=%i verbose=%i path=%s str=%s int=%li\n", args.foo, args.bar, args.verbose, args.path, args.str,
+         args.long_val);
 
+  optparse_state_release(&state);
   return 0;
 }
@@ -1,388 +1,3431 @@
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "optparse.h"
+
+extern char** environ;
+
+typedef char opt_max_env_options_power_of_two_[(OPT_MAX_ENV_OPTIONS & (OPT_MAX_ENV_OPTIONS - 1)) == 0 ? 1 : -1];
+
+/* Offsets of the arrays of a compiled parser in its storage */
+typedef struct {
+  size_t order;
+  size_t required;
+  size_t envs;
+  size_t keys;
+  size_t by_length;
+  size_t positions;
+  size_t n_slots;
+  size_t size;
+} ParserLayout;
+
+/* Lay out the arrays of a parser of `n_options` options in storage aligned to
+ * 8 bytes */
+static ParserLayout parser_layout(size_t n_options);
+
+/* Round `n` up to a multiple of 8 */
+static size_t align8(size_t n);
+
+/* Count the options of a list */
+static size_t count_options(OptionList const* opts);
+
+/* Append options of the list to the compiled order
+ *
+ * Appends either positional or non-positional options to the `count` options
+ * already in the order, so calling it twice places positionals at the end of
+ * the order.
+ */
+static void collect_options(Option const** order, size_t* count, OptionList* opts, bool positional);
+
+/* Parse arguments starting from `argv[start]`
+ *
+ * The arguments are taken from a cursor which advances over them once: an
+ * option argument is taken by the option before it and is never visited as a
+ * token. `origin` is the command line index of the response file the arguments
+ * are read from, or 0 for the command line. Arguments of response files never
+ * stop the parse, since the tail must be in the command line itself.
+ */
+static int parse_args(OptParser const* parser, OptParseState* state, int start, int argc, char** argv, int origin,
+                      OptParserError* err);
+
+/* Map a response file and parse its arguments
+ *
+ * The file is mapped privately right after an anonymous area reserving one
+ * byte past it, so every token, including the last one, is NUL-terminated in
+ * place. Unquoted tokens are moved to the start of the mapping, and pointers
+ * to them are stored after the file data. The mapping is kept in the parse
+ * state, since option values point into it.
+ */
+static int parse_response_file(OptParser const* parser, OptParseState* state, char* arg, int origin,
+                               OptParserError* err);
+
+/* Open a file for reading and get its size
+ *
+ * @return the file descriptor, -1 on error
+ */
+static int open_file(char const* path, size_t* size);
+
+/* Map a file of `size` bytes privately at the start of a `map_len` bytes
+ * anonymous mapping, keeping it in the state and closing the file
+ *
+ * @return the mapping, NULL on error
+ */
+static char* map_file(OptParseState* state, int fd, size_t size, size_t map_len);
+
+/* Size of the file data part of a mapping, with at least a byte past it */
+static size_t map_data_len(size_t size);
+
+/* Split response file contents into NUL-terminated tokens
+ *
+ * Tokens are separated by whitespace; single and double quotes and backslash
+ * escapes are removed in place.
+ *
+ * @return the number of tokens
+ */
+static int split_tokens(char* buf, size_t len, char** tokens);
+
+/* Find an option by its long name, the first `len` bytes of `str`
+ *
+ * Falls back to a unique prefix match if abbreviations are enabled, sets
+ * `ambiguous` if the name is a prefix of several long names.
+ */
+static Option const* find_option_lname(OptParser const* parser, char const* str, size_t len, bool* ambiguous);
+
+/* Find the first sorted option whose long name is not less than the name */
+static size_t find_option_sorted(OptIndex const* index, char const* str, size_t len);
+
+/* Find the only option whose long name starts with the name */
+static Option const* find_option_prefix(OptParser const* parser, char const* str, size_t len, bool* ambiguous);
+
+/* Compare a long name with the first `len` bytes of `str`, like strcmp */
+static int compare_name(char const* lname, char const* str, size_t len);
+
+/* Find the long name closest to the first `len` bytes of `str` by edit
+ * distance, NULL if none is close enough */
+static char const* suggest_lname(OptParser const* parser, char const* str, size_t len);
+
+/* Edit distance of two strings of up to OPT_SUGGEST_MAX_LEN bytes, counting
+ * a swap of adjacent characters as one edit; `bound + 1` if it is over `bound` */
+static size_t edit_distance(char const* a, size_t a_len, char const* b, size_t b_len, size_t bound);
+
+/* qsort comparator of options by long name */
+static int compare_lnames(void const* lhs, void const* rhs);
+
+/* Find an option by its long name using the lookup index */
+static Option const* find_option_lname_indexed(OptIndex const* index, char const* str, size_t len);
+
+/* FNV-1a hash of the first `len` bytes of a string */
+static uint32_t hash_name(char const* str, size_t len);
+
+/* Prepare index slots for `count` options */
+static int index_init(OptIndex* index, size_t count, OptIndexSlot* slots, size_t n_slots);
+
+/* Insert an option into the index */
+static void index_insert(OptIndex* index, Option const* opt);
+
+/* Insert an option into the index under a name */
+static void index_insert_name(OptIndex* index, Option const* opt, char const* name);
+
+/* Fill a table of options indexed by their short names */
+static void build_short_table(OptParser* parser);
+
+/* Set the bits of required options in the required mask */
+static void build_required_mask(OptParser* parser, uint64_t* required);
+
+/* Set the bits of options with an environment variable in the env mask */
+static void build_env_mask(OptParser* parser, uint64_t* envs);
+
+/* Compute the long name keys of non-positional options and sort them */
+static void build_keys(OptParser* parser, OptKey* keys);
+
+/* Check if a key is ordered before another, equal keys by their position */
+static bool key_less(OptKey const* a, OptKey const* b);
+
+/* Sort keys in place by heapsort, `qsort` may allocate */
+static void sort_keys(OptKey* keys, size_t n);
+
+/* Move the key at `i` down the heap of `n` keys */
+static void sift_key(OptKey* keys, size_t i, size_t n);
+
+/* Long name key of the first `len` bytes of a string */
+static uint64_t name_key(char const* str, size_t len);
+
+/* Sort non-positional options by the length of their long names into the
+ * length buckets */
+static void build_length_buckets(OptParser* parser, uint32_t* by_length);
+
+/* Get the destination of an option for the current parse */
+static void* option_dest(Option const* opt, OptParseState const* state);
+
+/* Assign a value to an option and mark it as activated
+ *
+ * `token` is the argument naming the option, used for error reporting.
+ * `value` is the argument of the option, or NULL if it has none.
+ */
+static int execute_option(OptParser const* parser, Option const* opt, OptParseState* state, char const* token,
+                          char* value, OptParserError* err);
+
+/* Position of an option in the parser order */
+static size_t option_position(OptParser const* parser, Option const* opt);
+
+/* Slot of an option address in the positions table */
+static size_t position_slot(Option const* opt, size_t mask);
+
+/* Fill the positions table, or set the table if the order is a single array */
+static void build_positions(OptParser* parser, uint32_t* positions, size_t n_slots);
+
+/* Result of a numeric argument conversion */
+typedef enum {
+  NUM_OK,
+  NUM_INVALID,
+  NUM_RANGE,
+} NumResult;
+
+/* Convert a numeric option argument into the destination of the option */
+static int store_number(Option const* opt, void* dest, char const* token, char const* value, OptParserError* err);
+
+/* Parse unsigned decimal, or hexadecimal with a 0x prefix, digits
+ *
+ * Stops at the first character that is not a digit and stores its position
+ * into `end`. At least one digit is required, the value must not exceed `max`.
+ */
+static NumResult parse_digits(char const* str, uint64_t max, char const** end, uint64_t* out);
+
+/* Parse a whole string as an optionally signed integer in the range of long */
+static NumResult parse_long(char const* str, long* out);
+
+/* Parse a whole string as an unsigned integer not greater than `max` */
+static NumResult parse_unsigned(char const* str, uint64_t max, uint64_t* out);
+
+/* Parse a whole string as a size with an optional K, M, G or T suffix */
+static NumResult parse_size(char const* str, uint64_t* out);
+
+/* Parse a whole string as a double
+ *
+ * The decimal point is '.' whatever the locale: `strtod` is called with the
+ * "C" numeric locale installed for the thread.
+ */
+static NumResult parse_double(char const* str, double* out);
+
+/* Convert a plain decimal without calling `strtod`
+ *
+ * Handles decimals with at most 19 significant digits whose value and power of
+ * ten are both exactly representable, so a single multiplication or division
+ * gives a correctly rounded result. Returns false for anything else, including
+ * hexadecimal floats, infinities, NaNs and malformed input, which are left to
+ * `strtod`.
+ */
+static bool parse_double_fast(char const* str, double* out);
+
+/* Create the "C" numeric locale used by `parse_double` */
+static void c_numeric_init(void);
+
+/* Append an option argument to the list destination of the option */
+static int append_value(Option const* opt, size_t position, OptParseState* state, void* dest, char const* token,
+                        char* value, OptParserError* err);
+
+/* Make room for `n` more items of a list in the arena
+ *
+ * An array at the top of the arena grows in place, otherwise it is moved to
+ * the top with its capacity at least doubled, aligned to the item size.
+ * Stores the new capacity.
+ *
+ * @return the items array, NULL if the arena is full or not set
+ */
+static void* arena_reserve(OptParseState* state, void* items, size_t count, size_t* capacity, size_t n,
+                           size_t item_size);
+
+/* Error of a failed `arena_reserve` */
+static OptParserErrorType arena_error(OptParseState const* state);
+
+/* Append the items of a comma-separated integer list argument
+ *
+ * Counts the items first, so the list grows at most once per argument, and
+ * converts them straight into the arena.
+ */
+static int store_int_list(size_t position, OptParseState* state, void* dest, char const* token, char const* value,
+                          OptParserError* err);
+
+/* Parse a decimal integer list item at `str`
+ *
+ * Stops at the first character that is not a digit and stores its position
+ * into `end`, or the start of the item if it is out of range. `limit` is the
+ * end of the argument, up to which digits are scanned eight at a time.
+ */
+static NumResult parse_list_item(char const* str, char const* limit, char const** end, long* out);
+
+/* Store the next positional argument, if there is one left */
+static Option const* store_positional(OptParser const* parser, OptParseState* state, char* value);
+
+/* Activated bits of a state, in the storage set by `optparse_state_bits` if
+ * there is one */
+static uint64_t* state_bits(OptParseState* state);
+
+/* Check if the activated bits of a state have room for the options of a
+ * parser */
+static bool state_fits(OptParser const* parser, OptParseState const* state);
+
+/* Reset the state for a new parse, unmapping the files of the previous one */
+static void reset_state(OptParser const* parser, OptParseState* state);
+
+/* Clear the parse results of the state, keeping its files mapped */
+static void clear_state(OptParser const* parser, OptParseState* state);
+
+/* Take values of options not given in the arguments from the environment
+ *
+ * Options with an `env` name which are not activated are inserted into a hash
+ * table on the stack by their variable names, then every variable of the
+ * environment is looked up in it.
+ */
+static int apply_env(OptParser const* parser, OptParseState* state, OptParserError* err);
+
+/* Assign the value of an environment variable to an option unless it is
+ * activated */
+static int apply_env_value(OptParser const* parser, Option const* opt, OptParseState* state, char* value,
+                           OptParserError* err);
+
+/* Take values of options not given in the arguments or the environment from
+ * the config file of the parser, if its config option has a path */
+static int apply_config(OptParser const* parser, OptParseState* state, OptParserError* err);
+
+/* Parse `key = value` lines of a mapped config file in place */
+static int parse_config(OptParser const* parser, OptParseState* state, char* data, size_t size, char const* path,
+                        OptParserError* err);
+
+/* Check if a character is a space within a config line */
+static bool is_blank(char c);
+
+/* Check if an environment or config value activates an option without an
+ * argument */
+static bool is_enabling(char const* value);
+
+/* Check for missing positionals and required options after a parse */
+static int check_complete(OptParser const* parser, OptParseState* state, OptParserError* err);
+
+/* Report the error in `err` of the argument at `index`
+ *
+ * In collect mode, an error the parse can recover from is stored into the
+ * error array.
+ *
+ * @return 0 if the parse can go on, -1 otherwise
+ */
+static int report_error(OptParseState* state, OptParserError* err, int index);
+
+/* Check if a parse can go on after an error */
+static bool is_recoverable(OptParserErrorType type);
+
+/* Store an error into the error array of the collect mode */
+static void collect_error(OptParseState* state, OptParserError const* err);
+
+/* Finish a parse in collect mode
+ *
+ * Stores the error of a failed parse into the error array, and fails a parse
+ * with collected errors, with the first one in `err`.
+ */
+static int finish_errors(OptParseState* state, int ret, OptParserError* err);
+
+/* Check if an option requires an argument */
+static bool opt_has_argument(Option const* opt);
+
+/* Parse short options group
+ *
+ * An option taking an argument takes the rest of the group as its value if it
+ * is not empty, otherwise the next argument of the cursor. With
+ * OPTPARSER_GROUP_ARGUMENTS every such option takes the next argument.
+ */
+static int parse_short_opts(OptParser const* parser, OptParseState* state, char* group, int index,
+                            OptArgvSource* args, OptParserError* err);
+
+static void bitset_set(uint64_t* bits, size_t idx);
+static bool bitset_test(uint64_t const* bits, size_t idx);
+
+/* Parse a whole argument array */
+static int parse_argv(OptParser const* parser, OptParseState* state, int argc, char** argv, OptParserError* err);
+
+/* Body of `opt_next` */
+static int iter_next(OptIter* iter, OptMatch* match, OptParserError* err);
+
+/* End the iteration with an OPTERROR_TOKEN_SOURCE error */
+static int iter_source_error(OptIter* iter, OptParserError* err);
+
+/* State of the `parse_opts` calls of this thread, the files mapped by the last
+ * call stay mapped until the next one or `parse_opts_release` */
+static __thread OptParseState opts_state;
+
+static pthread_once_t c_numeric_once = PTHREAD_ONCE_INIT;
+/* "C" numeric locale, or 0 if it could not be created */
+static locale_t c_numeric;
+
+#if defined(OPT_STATS)
+/* Stats of the parse running on this thread, NULL outside of parses */
+static __thread OptStats* current_stats;
+/* Start of the current phase of the parse running on this thread */
+static __thread uint64_t phase_start;
+
+static OptStatsHook stats_hook;
+static void* stats_hook_ctx;
+
+/* Start collecting stats into a state, clearing them first if `reset` is set */
+static void stats_begin(OptParseState* state, bool reset);
+
+/* Add the time since the start of the phase to a phase time and start the next
+ * phase */
+static void stats_lap(uint64_t* phase_ns);
+
+/* Stop collecting stats, passing them to the hook if `report` is set */
+static void stats_end(bool report);
+
+/* Monotonic clock in nanoseconds */
+static uint64_t stats_now(void);
+
+#define STATS_ADD(FIELD, N) (current_stats ? (void)(current_stats->FIELD += (N)) : (void)0)
+#define STATS_BEGIN(STATE, RESET) stats_begin(STATE, RESET)
+#define STATS_LAP(FIELD) stats_lap(&current_stats->FIELD)
+#define STATS_END(REPORT) stats_end(REPORT)
+#else
+#define STATS_ADD(FIELD, N) ((void)0)
+#define STATS_BEGIN(STATE, RESET) ((void)0)
+#define STATS_LAP(FIELD) ((void)0)
+#define STATS_END(REPORT) ((void)0)
+#endif
+
+/* Help rendering buffer
+ *
+ * When full, the buffer is flushed to `fout` if it is set, otherwise the rest
+ * of the output is dropped. `total` counts all the output, including the
+ * dropped part.
+ */
+typedef struct {
+  char* data;
+  size_t size;
+  size_t len;
+  size_t total;
+  FILE* fout;
+} OptBuf;
+
+static void buf_write(OptBuf* buf, char const* data, size_t len);
+static void buf_puts(OptBuf* buf, char const* str);
+static void buf_putc(OptBuf* buf, char c);
+static void buf_pad(OptBuf* buf, size_t n);
+static void buf_flush(OptBuf* buf);
+
+/* Print usage or help of a parser, from its help cache if it has one */
+static void print_rendered(OptParser const* parser, FILE* fout, bool help);
+
+/* Render the usage line without the program name */
+static void render_usage(OptParser const* parser, OptBuf* buf);
+static void render_help(OptParser const* parser, OptBuf* buf);
+
+/* Render the help entry of an option */
+static void render_help_entry(OptParser const* parser, Option const* opt, OptBuf* buf);
+
+/* Render help entries of the options of a group, NULL for no group */
+static void render_help_group(OptParser const* parser, char const* group, OptBuf* buf);
+
+/* Render help entries of the long options starting with a prefix */
+static void render_help_prefix(OptParser const* parser, char const* prefix, OptBuf* buf);
+
+static void print_option(Option const* opt, OptBuf* buf);
+static void print_option_bare(Option const* opt, OptBuf* buf);
+static void print_option_names(Option const* opt, OptBuf* buf);
+
+/* Print the completion candidates of the word at `idx`
+ *
+ * `words[0]` is the program or subcommand name, `idx` is at least 1 and not
+ * greater than `n_words`, the index of an empty word past the end.
+ */
+static void complete_words(OptParser const* parser, OptCommand const* commands, size_t n_commands, char** words,
+                           int n_words, int idx, OptBuf* buf);
+
+/* Print long options starting with the first `len` bytes of `prefix` */
+static void complete_long(OptParser const* parser, char const* prefix, size_t len, OptBuf* buf);
+
+/* Print the metavar line of an option argument */
+static void complete_value(Option const* opt, OptBuf* buf);
+
+/* Find the option taking the `k`-th argument following an option token
+ *
+ * Stores the number of following arguments the token takes into `count`.
+ */
+static Option const* token_value_option(OptParser const* parser, char const* token, size_t k, size_t* count);
+
+/* Print an option name after `-` or `--` with a separator */
+static void print_completion_name(Option const* opt, bool lname, OptBuf* buf, char sep);
+
+/* Output of `print_list` */
+typedef enum {
+  LIST_USAGE,
+  LIST_HELP,
+  LIST_HELP_GROUP,
+  LIST_HELP_PREFIX,
+} ListOutput;
+
+/* Compile an option list into storage on the stack and print it
+ *
+ * `arg` is the program name of the usage, the group or the prefix.
+ */
+static void print_list(OptionList* opts, ListOutput output, char const* arg, FILE* fout);
+
+/* Header of a parse snapshot, followed by the activated bits and a record of
+ * every activated option and every positional, as a 64-bit length followed by
+ * the value */
+typedef struct {
+  char magic[8];
+  uint64_t spec_hash;
+  uint64_t size;
+  uint64_t n_options;
+  uint64_t pos_count;
+  int64_t tail;
+} OptSnapshotHeader;
+
+static char const snapshot_magic[8] = "OPTSNAP\1";
+
+/* Write a snapshot into a buffer, which counts its size
+ *
+ * @return 0 on success, -1 if an OPTION_CALLBACK option was given
+ */
+static int snapshot_write(OptParser const* parser, OptParseState const* state, OptBuf* buf);
+
+/* Write a snapshot record of an activated option */
+static int snapshot_write_option(Option const* opt, void const* dest, OptBuf* buf);
+
+/* Read the value of an activated option from a snapshot record */
+static int snapshot_read_option(Option const* opt, OptParseState* state, char const* data, size_t len,
+                                OptParserError* err);
+
+/* Take the next record of a snapshot, NULL if it is truncated */
+static char const* snapshot_record(char const** p, char const* end, size_t* len);
+
+/* Body of `optsnapshot_load`, which leaves the files of the state mapped */
+static int snapshot_load(OptParser const* parser, OptParseState* state, void const* data, size_t size,
+                         OptParserError* err);
+
+/* Hash of the names, types and offsets of the options of a parser */
+static uint64_t spec_hash(OptParser const* parser);
+
+/* FNV-1a step of a 64-bit hash over `len` bytes */
+static uint64_t hash_bytes(uint64_t hash, void const* data, size_t len);
+
+/* Size of the destination of an option with a fixed size value, 0 for other
+ * options */
+static size_t value_size(OptionType type);
+
+size_t optparser_size(OptionList const* opts) {
+  assert(opts);
+  /* the storage may be unaligned */
+  return parser_layout(count_options(opts)).size + sizeof(uint64_t) - 1;
+}
+
+int optparser_compile(OptParser* parser, OptionList* opts, void* data, size_t size) {
+  assert(parser);
+  assert(opts);
+  assert(data || size == 0);
+
+  OPTLIST_FOREACH(opts, opt) {
+    if ((opt->type == OPTION_CALLBACK || opt->type == OPTION_LAZY) && !opt->convert)
+      return -2;
+  }
+
+  ParserLayout const layout = parser_layout(count_options(opts));
+  size_t const pad = (size_t)((sizeof(uint64_t) - (uintptr_t)data % sizeof(uint64_t)) % sizeof(uint64_t));
+  if (size < pad || size - pad < layout.size)
+    return -1;
+  char* const storage = (char*)data + pad;
+
+  Option const** order = (Option const**)(void*)(storage + layout.order);
+  size_t n_options = 0;
+  collect_options(order, &n_options, opts, false);
+  size_t const n_flags = n_options;
+  collect_options(order, &n_options, opts, true);
+  parser->order = order;
+  parser->n_options = n_options;
+  parser->n_positionals = n_options - n_flags;
+  build_positions(parser, (uint32_t*)(void*)(storage + layout.positions), layout.n_slots);
+  parser->index = opts->index;
+  parser->help_cache = NULL;
+  parser->flags = 0;
+  build_short_table(parser);
+  build_required_mask(parser, (uint64_t*)(void*)(storage + layout.required));
+  build_env_mask(parser, (uint64_t*)(void*)(storage + layout.envs));
+  build_keys(parser, (OptKey*)(void*)(storage + layout.keys));
+  build_length_buckets(parser, (uint32_t*)(void*)(storage + layout.by_length));
+
+  parser->config = NULL;
+  for (size_t i = 0; i < n_flags && !parser->config; ++i) {
+    if (parser->order[i]->type == OPTION_CONFIG)
+      parser->config = parser->order[i];
+  }
+
+  return 0;
+}
+
+void optparse_state_init(OptParseState* state, void* base) {
+  assert(state);
+  *state = (OptParseState){.base = base};
+}
+
+void optparse_state_bits(OptParseState* state, uint64_t* bits, size_t n_words) {
+  assert(state);
+  assert(bits || n_words == 0);
+  state->bits = bits;
+  state->bits_words = bits ? n_words : 0;
+}
+
+void optparse_state_arena(OptParseState* state, void* data, size_t size) {
+  assert(state);
+  state->arena = data;
+  state->arena_size = size;
+  state->arena_used = 0;
+}
+
+int optparser_parse(OptParser const* parser, OptParseState* state, int argc, char** argv, OptParserError* err) {
+  assert(parser);
+  assert(state);
+  assert(argv);
+  assert(err);
+
+  STATS_BEGIN(state, true);
+  int const ret = parse_argv(parser, state, argc, argv, err);
+  STATS_END(true);
+  return ret;
+}
+
+int optlazy_convert(OptLazy* lazy, OptParserError* err) {
+  assert(lazy);
+  assert(err);
+
+  if (lazy->status == OPTLAZY_PENDING) {
+    assert(lazy->opt->convert);
+    STATS_ADD(conversions, 1);
+    lazy->status = lazy->opt->convert(lazy->opt, lazy->raw, lazy) == -1 ? OPTLAZY_FAILED : OPTLAZY_DONE;
+  }
+  if (lazy->status == OPTLAZY_FAILED) {
+    *err = (OptParserError){OPTERROR_INVALID_ARGUMENT, .opt = lazy->raw, .sname = lazy->opt->sname,
+                            .lname = lazy->opt->lname};
+    return -1;
+  }
+  return 0;
+}
+
+int optparser_convert(OptParser const* parser, OptParseState* state, OptParserError* err) {
+  assert(parser);
+  assert(state);
+  assert(err);
+
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    if (opt->type != OPTION_LAZY || !bitset_test(state_bits(state), i))
+      continue;
+    if (optlazy_convert(option_dest(opt, state), err) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+size_t optsnapshot_size(OptParser const* parser, OptParseState const* state) {
+  assert(parser);
+  assert(state);
+
+  OptBuf buf = {0};
+  snapshot_write(parser, state, &buf);
+  return buf.total;
+}
+
+int optsnapshot_save(OptParser const* parser, OptParseState const* state, void* data, size_t size) {
+  assert(parser);
+  assert(state);
+  assert(data || size == 0);
+
+  OptBuf buf = {.data = data, .size = size};
+  if (snapshot_write(parser, state, &buf) == -1 || buf.total > size)
+    return -1;
+  uint64_t const total = buf.total;
+  memcpy((char*)data + offsetof(OptSnapshotHeader, size), &total, sizeof(total));
+  return 0;
+}
+
+int optsnapshot_load(OptParser const* parser, OptParseState* state, void const* data, size_t size,
+                     OptParserError* err) {
+  assert(parser);
+  assert(state);
+  assert(data || size == 0);
+  assert(err);
+
+  optparse_state_release(state);
+  return snapshot_load(parser, state, data, size, err);
+}
+
+int optsnapshot_load_file(OptParser const* parser, OptParseState* state, char const* path, OptParserError* err) {
+  assert(parser);
+  assert(state);
+  assert(path);
+  assert(err);
+
+  optparse_state_release(state);
+  size_t size;
+  int const fd = open_file(path, &size);
+  char const* data = fd == -1 ? NULL : map_file(state, fd, size, map_data_len(size));
+  if (!data) {
+    *err = (OptParserError){OPTERROR_SNAPSHOT, .opt = path};
+    return -1;
+  }
+  return snapshot_load(parser, state, data, size, err);
+}
+
+int optparser_parse_command(OptParser const* parser, OptParseState* state, OptCommand const* commands,
+                            size_t n_commands, OptParseState* command_state, int argc, char** argv,
+                            OptCommand const** command, OptParserError* err) {
+  assert(parser);
+  assert(state);
+  assert(commands || n_commands == 0);
+  assert(command_state);
+  assert(argv);
+  assert(command);
+  assert(err);
+
+  *command = NULL;
+
+  state->stop_at_positional = true;
+  int const ret = optparser_parse(parser, state, argc, argv, err);
+  state->stop_at_positional = false;
+  if (ret == -1)
+    return -1;
+
+  if (state->tail == argc) {
+    *err = (OptParserError){.type = OPTERROR_EXPECTED_COMMAND};
+    return -1;
+  }
+
+  char* const name = argv[state->tail];
+  for (size_t i = 0; i < n_commands; ++i) {
+    if (strcmp(commands[i].name, name) == 0) {
+      *command = &commands[i];
+      break;
+    }
+  }
+
+  optparse_state_init(command_state, NULL);
+  OptParser const* command_parser = *command ? (*command)->setup(*command, command_state) : NULL;
+  if (!command_parser) {
+    *err = (OptParserError){OPTERROR_UNKNOWN_COMMAND, .opt = name};
+    return -1;
+  }
+
+  return optparser_parse(command_parser, command_state, argc - state->tail, argv + state->tail, err);
+}
+
+void optcommand_print_help(OptCommand const* commands, size_t n_commands, FILE* fout) {
+  assert(commands || n_commands == 0);
+  assert(fout);
+
+  char data[OPT_HELP_BUFFER_SIZE];
+  OptBuf buf = {.data = data, .size = sizeof(data), .fout = fout};
+  for (size_t i = 0; i < n_commands; ++i) {
+    size_t const start = buf.total;
+    buf_puts(&buf, "  ");
+    buf_puts(&buf, commands[i].name);
+    if (commands[i].help) {
+      size_t const column_len = buf.total - start;
+      if (column_len >= OPT_COLUMN_WIDTH) {
+        buf_putc(&buf, '\n');
+        buf_pad(&buf, OPT_COLUMN_WIDTH);
+      } else {
+        buf_pad(&buf, OPT_COLUMN_WIDTH - column_len);
+      }
+      buf_puts(&buf, commands[i].help);
+    }
+    buf_putc(&buf, '\n');
+  }
+  buf_flush(&buf);
+}
+
+int optparser_complete(OptParser const* parser, OptCommand const* commands, size_t n_commands, int argc, char** argv,
+                       FILE* fout) {
+  assert(parser);
+  assert(commands || n_commands == 0);
+  assert(argv);
+  assert(fout);
+
+  if (argc < 2 || strcmp(argv[1], OPT_COMPLETE_ARG) != 0)
+    return 0;
+
+  uint64_t idx = 0;
+  int const n_words = argc - 3;
+  if (n_words < 1 || parse_unsigned(argv[2], (uint64_t)n_words, &idx) != NUM_OK || idx == 0)
+    return 1;
+
+  char data[OPT_HELP_BUFFER_SIZE];
+  OptBuf buf = {.data = data, .size = sizeof(data), .fout = fout};
+  complete_words(parser, commands, n_commands, argv + 3, n_words, (int)idx, &buf);
+  buf_flush(&buf);
+  return 1;
+}
+
+void optparser_print_completion(OptParser const* parser, OptCommand const* commands, size_t n_commands,
+                                char const* progname, FILE* fout) {
+  assert(parser);
+  assert(commands || n_commands == 0);
+  assert(progname);
+  assert(fout);
+
+  char const* last_slash = strrchr(progname, '/');
+  char const* name = last_slash ? last_slash + 1 : progname;
+  size_t const n_flags = parser->n_options - parser->n_positionals;
+
+  char data[OPT_HELP_BUFFER_SIZE];
+  OptBuf buf = {.data = data, .size = sizeof(data), .fout = fout};
+
+  /* the function name is the program name with non-identifier characters
+   * replaced */
+  char function[64] = "_";
+  size_t len = 1;
+  for (char const* c = name; *c && len + 1 < sizeof(function); ++c) {
+    bool const ident = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9');
+    function[len++] = ident ? *c : '_';
+  }
+  function[len] = '\0';
+
+  buf_puts(&buf, function);
+  buf_puts(&buf, "() {\n");
+  buf_puts(&buf, "  local cur=\"${COMP_WORDS[COMP_CWORD]}\" prev=\"${COMP_WORDS[COMP_CWORD-1]}\" i out\n");
+  if (n_commands > 0) {
+    buf_puts(&buf, "  for ((i = 1; i < COMP_CWORD; ++i)); do\n");
+    buf_puts(&buf, "    case \"${COMP_WORDS[i]}\" in\n");
+    buf_puts(&buf, "    ");
+    for (size_t i = 0; i < n_commands; ++i) {
+      if (i > 0)
+        buf_putc(&buf, '|');
+      buf_puts(&buf, commands[i].name);
+    }
+    buf_puts(&buf, ")\n");
+    buf_puts(&buf, "      out=$(\"${COMP_WORDS[0]}\" " OPT_COMPLETE_ARG " \"$COMP_CWORD\" \"${COMP_WORDS[@]}\")\n");
+    buf_puts(&buf, "      if [[ $out == :* ]]; then\n");
+    buf_puts(&buf, "        COMPREPLY=($(compgen -f -- \"$cur\"))\n");
+    buf_puts(&buf, "      else\n");
+    buf_puts(&buf, "        COMPREPLY=($out)\n");
+    buf_puts(&buf, "      fi\n");
+    buf_puts(&buf, "      return;;\n");
+    buf_puts(&buf, "    esac\n");
+    buf_puts(&buf, "  done\n");
+  }
+
+  bool any_value = false;
+  for (size_t i = 0; i < n_flags; ++i) {
+    Option const* opt = parser->order[i];
+    if (!opt_has_argument(opt))
+      continue;
+    buf_puts(&buf, any_value ? "|" : "  case \"$prev\" in\n  ");
+    any_value = true;
+    if (opt->sname)
+      print_completion_name(opt, false, &buf, opt->lname ? '|' : 0);
+    if (opt->lname)
+      print_completion_name(opt, true, &buf, 0);
+  }
+  if (any_value) {
+    buf_puts(&buf, ")\n    COMPREPLY=($(compgen -f -- \"$cur\"))\n    return;;\n  esac\n");
+  }
+
+  buf_puts(&buf, "  case \"$cur\" in\n  -*)\n    COMPREPLY=($(compgen -W \"");
+  size_t const words_start = buf.total;
+  for (size_t i = 0; i < 2 * n_flags; ++i) {
+    /* long names first, then short ones */
+    Option const* opt = parser->order[i % n_flags];
+    bool const lname = i < n_flags;
+    if (lname ? !opt->lname : !opt->sname)
+      continue;
+    if (buf.total != words_start)
+      buf_putc(&buf, ' ');
+    print_completion_name(opt, lname, &buf, 0);
+  }
+  buf_puts(&buf, "\" -- \"$cur\"));;\n  *)\n");
+  if (n_commands > 0) {
+    buf_puts(&buf, "    COMPREPLY=($(compgen -W \"");
+    for (size_t i = 0; i < n_commands; ++i) {
+      if (i > 0)
+        buf_putc(&buf, ' ');
+      buf_puts(&buf, commands[i].name);
+    }
+    buf_puts(&buf, "\" -- \"$cur\"));;\n");
+  } else {
+    buf_puts(&buf, "    COMPREPLY=($(compgen -f -- \"$cur\"));;\n");
+  }
+  buf_puts(&buf, "  esac\n}\ncomplete -F ");
+  buf_puts(&buf, function);
+  buf_putc(&buf, ' ');
+  buf_puts(&buf, name);
+  buf_putc(&buf, '\n');
+  buf_flush(&buf);
+}
+
+void optiter_init(OptIter* iter, OptParser const* parser, OptParseState* state, OptTokenSource source, void* ctx) {
+  assert(iter);
+  assert(parser);
+  assert(state);
+  assert(source);
+
+  STATS_BEGIN(state, true);
+  /* a state without room is reported by the first `opt_next` */
+  if (state_fits(parser, state))
+    reset_state(parser, state);
+  STATS_END(false);
+  *iter = (OptIter){parser, state, source, ctx, NULL, 0, false, false};
+}
+
+int opt_next(OptIter* iter, OptMatch* match, OptParserError* err) {
+  assert(iter);
+  assert(match);
+  assert(err);
+
+  STATS_BEGIN(iter->state, false);
+  int const ret = iter_next(iter, match, err);
+  STATS_LAP(parse_ns);
+  STATS_END(ret != 1);
+  return ret;
+}
+
+static int iter_next(OptIter* iter, OptMatch* match, OptParserError* err) {
+  OptParser const* parser = iter->parser;
+  OptParseState* state = iter->state;
+
+  if (iter->done)
+    return 0;
+  if (!state_fits(parser, state)) {
+    iter->done = true;
+    *err = (OptParserError){.type = OPTERROR_TOO_MANY_OPTIONS};
+    return -1;
+  }
+
+  char* token = iter->group;
+  if (!token) {
+    token = iter->source(iter->ctx);
+    if (token && token != opt_source_error && !iter->options_done && strcmp(token, "--") == 0) {
+      iter->options_done = true;
+      token = parser->flags & OPTPARSER_STOP_AT_TERMINATOR ? NULL : iter->source(iter->ctx);
+    }
+    if (token == opt_source_error)
+      return iter_source_error(iter, err);
+    if (!token) {
+      iter->done = true;
+      if (apply_env(parser, state, err) == -1)
+        return -1;
+      if (parser->config && apply_config(parser, state, err) == -1)
+        return -1;
+      if (check_complete(parser, state, err) == -1)
+        return -1;
+      return finish_errors(state, 0, err);
+    }
+    STATS_ADD(tokens, 1);
+  }
+
+  Option const* opt = NULL;
+  char* inline_value = NULL;
+  if (iter->options_done) {
+    *match = (OptMatch){store_positional(parser, state, token), token};
+    return 1;
+  } else if (iter->group) {
+    STATS_ADD(lookups, 1);
+    opt = parser->shorts[(unsigned char)token[iter->group_pos]];
+    iter->group_pos += 1;
+    if (!token[iter->group_pos])
+      iter->group = NULL;
+  } else if (token[0] == '-' && token[1] == '-') {
+    bool ambiguous = false;
+    char* eq = strchr(token + 2, '=');
+    size_t const len = eq ? (size_t)(eq - token - 2) : strlen(token + 2);
+    opt = find_option_lname(parser, token + 2, len, &ambiguous);
+    if (ambiguous) {
+      *err = (OptParserError){OPTERROR_AMBIGUOUS, .opt = token};
+      return -1;
+    }
+    if (opt && eq) {
+      if (!opt_has_argument(opt)) {
+        *err = (OptParserError){OPTERROR_UNEXPECTED_ARGUMENT, .opt = token, .lname = opt->lname};
+        return -1;
+      }
+      inline_value = eq + 1;
+    }
+  } else if (token[0] == '-' && token[1]) {
+    STATS_ADD(lookups, 1);
+    opt = parser->shorts[(unsigned char)token[1]];
+    if (token[2]) {
+      iter->group = token;
+      iter->group_pos = 2;
+    }
+  } else {
+    /* positionals past the declared ones are left to the caller */
+    *match = (OptMatch){store_positional(parser, state, token), token};
+    return 1;
+  }
+
+  if (!opt) {
+    iter->group = NULL;
+    *err = (OptParserError){OPTERROR_UNKNOWN, .opt = token};
+    if (token[1] == '-')
+      err->suggestion = suggest_lname(parser, token + 2, strcspn(token + 2, "="));
+    return -1;
+  }
+
+  char* value = NULL;
+  if (opt_has_argument(opt)) {
+    if (iter->group && !(parser->flags & OPTPARSER_GROUP_ARGUMENTS)) {
+      inline_value = token + iter->group_pos;
+      iter->group = NULL;
+    }
+    value = inline_value ? inline_value : iter->source(iter->ctx);
+    if (value == opt_source_error)
+      return iter_source_error(iter, err);
+  }
+  if (execute_option(parser, opt, state, token, value, err) == -1)
+    return -1;
+
+  *match = (OptMatch){opt, value};
+  return 1;
+}
+
+char* opt_argv_source(void* ctx) {
+  OptArgvSource* src = ctx;
+  return src->idx < src->argc ? src->argv[src->idx++] : NULL;
+}
+
+char opt_source_error[1];
+
+char* opt_nul_stream_source(void* ctx) {
+  OptNulStream* stream = ctx;
+  size_t len = 0;
+  int c;
+  while ((c = getc_unlocked(stream->fin)) != EOF && c != '\0') {
+    if (len + 1 >= stream->size) {
+      /* skip the rest, so the next token starts past it */
+      while ((c = getc_unlocked(stream->fin)) != EOF && c != '\0')
+        ;
+      stream->overflow = true;
+      return opt_source_error;
+    }
+    stream->buf[len++] = (char)c;
+  }
+  if (c == EOF && len == 0)
+    return NULL;
+  if (stream->size == 0) {
+    stream->overflow = true;
+    return opt_source_error;
+  }
+  stream->buf[len] = '\0';
+  return stream->buf;
+}
+
+void optparse_state_errors(OptParseState* state, OptParserError* errors, size_t capacity) {
+  assert(state);
+  assert(errors || capacity == 0);
+  state->errors = errors;
+  state->errors_capacity = capacity;
+  state->n_errors = 0;
+}
+
+void optparse_state_release(OptParseState* state) {
+  assert(state);
+  for (size_t i = 0; i < state->n_maps; ++i)
+    munmap(state->maps[i].addr, state->maps[i].len);
+  state->n_maps = 0;
+}
+
+#if defined(OPT_STATS)
+void optparse_stats_hook(OptStatsHook hook, void* ctx) {
+  stats_hook = hook;
+  stats_hook_ctx = ctx;
+}
+#endif
+
+void optparser_print_usage(OptParser const* parser, FILE* fout, char const* progname) {
+  assert(parser);
+  assert(fout);
+
+  char const* last_slash = strrchr(progname, '/');
+  fputs(last_slash ? last_slash + 1 : progname, fout);
+  fputc(' ', fout);
+  print_rendered(parser, fout, false);
+}
+
+void optparser_print_help(OptParser const* parser, FILE* fout) {
+  assert(parser);
+  assert(fout);
+  print_rendered(parser, fout, true);
+}
+
+void optparser_print_help_group(OptParser const* parser, char const* group, FILE* fout) {
+  assert(parser);
+  assert(fout);
+
+  char data[OPT_HELP_BUFFER_SIZE];
+  OptBuf buf = {.data = data, .size = sizeof(data), .fout = fout};
+  render_help_group(parser, group, &buf);
+  buf_flush(&buf);
+}
+
+void optparser_print_help_prefix(OptParser const* parser, char const* prefix, FILE* fout) {
+  assert(parser);
+  assert(prefix);
+  assert(fout);
+
+  char data[OPT_HELP_BUFFER_SIZE];
+  OptBuf buf = {.data = data, .size = sizeof(data), .fout = fout};
+  render_help_prefix(parser, prefix, &buf);
+  buf_flush(&buf);
+}
+
+size_t opthelp_size(OptParser const* parser) {
+  assert(parser);
+
+  OptBuf buf = {0};
+  render_usage(parser, &buf);
+  render_help(parser, &buf);
+  return buf.total;
+}
+
+int opthelp_build(OptHelpCache* cache, OptParser const* parser, char* data, size_t size) {
+  assert(cache);
+  assert(parser);
+
+  OptBuf buf = {.data = data, .size = size};
+  render_usage(parser, &buf);
+  size_t const usage_len = buf.total;
+  render_help(parser, &buf);
+  if (buf.total > size)
+    return -1;
+
+  cache->text = data;
+  cache->usage_len = usage_len;
+  cache->help_len = buf.total - usage_len;
+  opthelp_measure(cache, parser);
+  return 0;
+}
+
+void opthelp_measure(OptHelpCache* cache, OptParser const* parser) {
+  assert(cache);
+  assert(parser);
+
+  if (!cache->widths)
+    return;
+  for (size_t i = 0; i < parser->n_options; ++i) {
+    OptBuf buf = {0};
+    buf_puts(&buf, "  ");
+    print_option_bare(parser->order[i], &buf);
+    cache->widths[i] = (uint16_t)(buf.total < UINT16_MAX ? buf.total : UINT16_MAX);
+  }
+  cache->has_widths = true;
+}
+
+int parse_opts(OptionList* opts, int argc, char** argv, OptParserError* err) {
+  assert(opts);
+  assert(argv);
+  assert(err);
+
+  OptParseState* state = &opts_state;
+  STATS_BEGIN(state, true);
+
+  /* the storage is sized by the list, so it always fits */
+  size_t const n_options = count_options(opts);
+  uint64_t data[parser_layout(n_options).size / sizeof(uint64_t) + 1];
+  uint64_t bits[n_options / 64 + 1];
+  OptParser parser;
+  if (optparser_compile(&parser, opts, data, sizeof(data)) != 0) {
+    STATS_END(false);
+    *err = (OptParserError){.type = OPTERROR_NO_CONVERTER};
+    return -1;
+  }
+  /* short groups keep the meaning they had before inline values */
+  parser.flags = OPTPARSER_GROUP_ARGUMENTS;
+  STATS_LAP(compile_ns);
+
+  optparse_state_bits(state, bits, sizeof(bits) / sizeof(*bits));
+  int const ret = parse_argv(&parser, state, argc, argv, err);
+  optparse_state_bits(state, NULL, 0);
+  STATS_END(true);
+  return ret;
+}
+
+void parse_opts_release(void) { optparse_state_release(&opts_state); }
+
+int optindex_build(OptIndex* index, OptionList const* opts, OptIndexSlot* slots, size_t n_slots) {
+  assert(index);
+  assert(opts);
+  assert(slots);
+
+  if (index_init(index, count_options(opts), slots, n_slots) == -1)
+    return -1;
+
+  OPTLIST_FOREACH(opts, opt) { index_insert(index, opt); }
+
+  return 0;
+}
+
+int optindex_build_parser(OptIndex* index, OptParser const* parser, OptIndexSlot* slots, size_t n_slots) {
+  assert(index);
+  assert(parser);
+  assert(slots);
+
+  if (index_init(index, parser->n_options, slots, n_slots) == -1)
+    return -1;
+
+  for (size_t i = 0; i < parser->n_options; ++i)
+    index_insert(index, parser->order[i]);
+
+  return 0;
+}
+
+int optindex_build_sorted(OptIndex* index, OptParser const* parser, Option const** sorted, size_t n_sorted) {
+  assert(index);
+  assert(parser);
+  assert(sorted);
+
+  size_t count = 0;
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    if (!opt->lname)
+      continue;
+    if (count == n_sorted)
+      return -1;
+    sorted[count++] = opt;
+  }
+
+  qsort(sorted, count, sizeof(*sorted), compare_lnames);
+  index->sorted = sorted;
+  index->n_sorted = count;
+  return 0;
+}
+
+void print_usage(OptionList* opts, FILE* fout, char const* progname) {
+  assert(opts);
+  assert(fout);
+  print_list(opts, LIST_USAGE, progname, fout);
+}
+
+void print_help(OptionList* opts, FILE* fout) {
+  assert(opts);
+  assert(fout);
+  print_list(opts, LIST_HELP, NULL, fout);
+}
+
+void print_help_group(OptionList* opts, char const* group, FILE* fout) {
+  assert(opts);
+  assert(fout);
+  print_list(opts, LIST_HELP_GROUP, group, fout);
+}
+
+void print_help_prefix(OptionList* opts, char const* prefix, FILE* fout) {
+  assert(opts);
+  assert(prefix);
+  assert(fout);
+  print_list(opts, LIST_HELP_PREFIX, prefix, fout);
+}
+
+char const* opterror_type_to_str(OptParserErrorType err_type) {
+  switch (err_type) {
+  case OPTERROR_NOERR:
+    return "no error";
+  case OPTERROR_UNKNOWN:
+    return "unknown option";
+  case OPTERROR_UNEXPECTED_POSITIONAL:
+    return "unexpected positional argument";
+  case OPTERROR_EXPECTED_POSITIONAL:
+    return "expected a positional argument";
+  case OPTERROR_ARGUMENT_REQUIRED:
+    return "option requires an argument";
+  case OPTERROR_REQUIRED_OPTION:
+    return "option required";
+  case OPTERROR_ONE_ARG_OPT_PER_GROUP:
+    return "one argument option allowed per short option group";
+  case OPTERROR_INT_TYPE_ERROR:
+    return "required argument of type int";
+  case OPTERROR_TOO_MANY_OPTIONS:
+    return "too many options in the option list";
+  case OPTERROR_RESPONSE_FILE:
+    return "cannot read response file";
+  case OPTERROR_UINT_TYPE_ERROR:
+    return "required argument of type unsigned int";
+  case OPTERROR_SIZE_TYPE_ERROR:
+    return "required argument of type size";
+  case OPTERROR_DOUBLE_TYPE_ERROR:
+    return "required argument of type double";
+  case OPTERROR_OUT_OF_RANGE:
+    return "argument out of range";
+  case OPTERROR_ARENA_FULL:
+    return "too many option values";
+  case OPTERROR_INT_LIST_TYPE_ERROR:
+    return "required argument of type comma-separated int list";
+  case OPTERROR_AMBIGUOUS:
+    return "ambiguous option";
+  case OPTERROR_EXPECTED_COMMAND:
+    return "expected a subcommand";
+  case OPTERROR_UNKNOWN_COMMAND:
+    return "unknown subcommand";
+  case OPTERROR_UNEXPECTED_ARGUMENT:
+    return "option does not take an argument";
+  case OPTERROR_CONFIG_FILE:
+    return "cannot read config file";
+  case OPTERROR_CONFIG_SYNTAX:
+    return "expected key = value in config file";
+  case OPTERROR_INVALID_ARGUMENT:
+    return "invalid argument";
+  case OPTERROR_SNAPSHOT:
+    return "invalid snapshot";
+  case OPTERROR_NO_ARENA:
+    return "append option without an arena";
+  case OPTERROR_NO_CONVERTER:
+    return "callback or lazy option without a converter";
+  case OPTERROR_TOKEN_SOURCE:
+    return "cannot read token";
+  default:
+    __builtin_unreachable();
+  }
+}
+
+void print_error(OptParserError* err, FILE* fout) {
+  assert(err);
+  assert(fout);
+
+  fprintf(fout, "%s: ", opterror_type_to_str(err->type));
+
+  if (err->opt) {
+    fprintf(fout, "%s ", err->opt);
+    if (err->column)
+      fprintf(fout, "at column %zu ", err->column);
+    if (err->line)
+      fprintf(fout, "at line %zu ", err->line);
+  }
+
+  if (err->sname) {
+    fprintf(fout, "-%c", err->sname);
+    if (err->lname)
+      fprintf(fout, "|");
+  }
+
+  if (err->lname)
+    fprintf(fout, "--%s", err->lname);
+
+  if (err->suggestion)
+    fprintf(fout, "(did you mean --%s?)", err->suggestion);
+
+  fprintf(fout, "\n");
+}
+
+static void buf_write(OptBuf* buf, char const* data, size_t len) {
+  buf->total += len;
+  while (len) {
+    if (buf->len == buf->size) {
+      if (!buf->fout)
+        return;
+      buf_flush(buf);
+    }
+    size_t const n = len < buf->size - buf->len ? len : buf->size - buf->len;
+    memcpy(buf->data + buf->len, data, n);
+    buf->len += n;
+    data += n;
+    len -= n;
+  }
+}
+
+static void buf_puts(OptBuf* buf, char const* str) { buf_write(buf, str, strlen(str)); }
+
+static void buf_putc(OptBuf* buf, char c) { buf_write(buf, &c, 1); }
+
+static void buf_pad(OptBuf* buf, size_t n) {
+  static char const spaces[] = "                                ";
+  for (; n > sizeof(spaces) - 1; n -= sizeof(spaces) - 1)
+    buf_write(buf, spaces, sizeof(spaces) - 1);
+  buf_write(buf, spaces, n);
+}
+
+static void buf_flush(OptBuf* buf) {
+  fwrite(buf->data, 1, buf->len, buf->fout);
+  buf->len = 0;
+}
+
+static void print_rendered(OptParser const* parser, FILE* fout, bool help) {
+  OptHelpCache const* cache = parser->help_cache;
+  if (cache && cache->text) {
+    if (help)
+      fwrite(cache->text + cache->usage_len, 1, cache->help_len, fout);
+    else
+      fwrite(cache->text, 1, cache->usage_len, fout);
+    return;
+  }
+
+  char data[OPT_HELP_BUFFER_SIZE];
+  OptBuf buf = {.data = data, .size = sizeof(data), .fout = fout};
+  if (help)
+    render_help(parser, &buf);
+  else
+    render_usage(parser, &buf);
+  buf_flush(&buf);
+}
+
+static void render_usage(OptParser const* parser, OptBuf* buf) {
+  /* positionals are placed at the end of the order */
+  for (size_t i = 0; i < parser->n_options; ++i)
+    print_option(parser->order[i], buf);
+
+  buf_putc(buf, '\n');
+}
+
+static void render_help(OptParser const* parser, OptBuf* buf) {
+  for (size_t i = 0; i < parser->n_options; ++i)
+    render_help_entry(parser, parser->order[i], buf);
+}
+
+static void collect_options(Option const** order, size_t* count, OptionList* opts, bool positional) {
+  OPTLIST_FOREACH(opts, opt) {
+    if ((opt->type == OPTION_POSITIONAL) != positional)
+      continue;
+    order[(*count)++] = opt;
+  }
+}
+
+static int parse_args(OptParser const* parser, OptParseState* state, int start, int argc, char** argv, int origin,
+                      OptParserError* err) {
+  bool const nested = origin != 0;
+  bool const stop_at_terminator = !nested && (parser->flags & OPTPARSER_STOP_AT_TERMINATOR);
+  bool const stop_at_positional =
+      !nested && (state->stop_at_positional || (parser->flags & OPTPARSER_STOP_AT_POSITIONAL));
+  bool options_done = false;
+  OptArgvSource args = {argc, argv, start};
+
+  while (args.idx < argc) {
+    int const i = args.idx++;
+    int const index = nested ? origin : i;
+    STATS_ADD(tokens, 1);
+    if (options_done || argv[i][0] != '-' || !argv[i][1]) {
+      if (argv[i][0] == '@' && !options_done && (parser->flags & OPTPARSER_RESPONSE_FILES)) {
+        if (parse_response_file(parser, state, argv[i], index, err) == -1)
+          return -1;
+      } else if (!store_positional(parser, state, argv[i])) {
+        if (stop_at_positional) {
+          state->tail = i;
+          return 0;
+        }
+        *err = (OptParserError){OPTERROR_UNEXPECTED_POSITIONAL, .opt = argv[i]};
+        if (report_error(state, err, index) == -1)
+          return -1;
+      }
+    } else if (argv[i][1] == '-' && !argv[i][2]) {
+      if (stop_at_terminator) {
+        state->tail = i + 1;
+        return 0;
+      }
+      options_done = true;
+    } else if (argv[i][1] == '-') {
+      /* only option tokens are scanned, up to the end of the name */
+      char* const name = argv[i] + 2;
+      size_t const len = strcspn(name, "=");
+      bool ambiguous = false;
+      Option const* opt = find_option_lname(parser, name, len, &ambiguous);
+      if (!opt) {
+        *err = (OptParserError){ambiguous ? OPTERROR_AMBIGUOUS : OPTERROR_UNKNOWN, .opt = argv[i]};
+        if (!ambiguous)
+          err->suggestion = suggest_lname(parser, name, len);
+        if (report_error(state, err, index) == -1)
+          return -1;
+        continue;
+      }
+      char* value = NULL;
+      if (name[len] == '=') {
+        if (!opt_has_argument(opt)) {
+          *err = (OptParserError){OPTERROR_UNEXPECTED_ARGUMENT, .opt = argv[i], .lname = opt->lname};
+          if (report_error(state, err, index) == -1)
+            return -1;
+          continue;
+        }
+        value = name + len + 1;
+      } else if (opt_has_argument(opt)) {
+        value = opt_argv_source(&args);
+      }
+      if (execute_option(parser, opt, state, argv[i], value, err) == -1 && report_error(state, err, index) == -1)
+        return -1;
+    } else {
+      if (parse_short_opts(parser, state, argv[i], index, &args, err) == -1)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_response_file(OptParser const* parser, OptParseState* state, char* arg, int origin,
+                               OptParserError* err) {
+  *err = (OptParserError){OPTERROR_RESPONSE_FILE, .opt = arg, .index = origin};
+  if (state->n_maps == OPT_MAX_RESPONSE_FILES)
+    return -1;
+
+  size_t size = 0;
+  int const fd = open_file(arg + 1, &size);
+  if (fd == -1)
+    return -1;
+
+  size_t const data_len = map_data_len(size);
+  /* a file of n bytes has at most n / 2 + 1 tokens */
+  size_t const max_tokens = size / 2 + 1;
+  char* map = map_file(state, fd, size, data_len + max_tokens * sizeof(char*));
+  if (!map)
+    return -1;
+
+  char** tokens = (char**)(void*)(map + data_len);
+  int const n_tokens = split_tokens(map, size, tokens);
+
+  int const ret = parse_args(parser, state, 0, n_tokens, tokens, origin, err);
+  if (ret == 0)
+    *err = (OptParserError){0};
+  return ret;
+}
+
+static int open_file(char const* path, size_t* size) {
+  int const fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  *size = (size_t)st.st_size;
+  return fd;
+}
+
+static char* map_file(OptParseState* state, int fd, size_t size, size_t map_len) {
+  char* map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (size > 0 && mmap(map, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(map, map_len);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  state->maps[state->n_maps++] = (OptMapping){map, map_len};
+  return map;
+}
+
+static size_t map_data_len(size_t size) {
+  size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+  return (size + 1 + page - 1) / page * page;
+}
+
+static int split_tokens(char* buf, size_t len, char** tokens) {
+  char const* r = buf;
+  char const* const end = buf + len;
+  char* w = buf;
+  int count = 0;
+
+  for (;;) {
+    while (r != end && (*r == ' ' || *r == '\t' || *r == '\n' || *r == '\r'))
+      ++r;
+    if (r == end)
+      break;
+
+    char* const token = w;
+    char quote = 0;
+    for (; r != end; ++r) {
+      if (quote) {
+        if (*r == quote)
+          quote = 0;
+        else
+          *w++ = *r;
+      } else if (*r == '\'' || *r == '"') {
+        quote = *r;
+      } else if (*r == '\\' && r + 1 != end) {
+        *w++ = *++r;
+      } else if (*r == ' ' || *r == '\t' || *r == '\n' || *r == '\r') {
+        break;
+      } else {
+        *w++ = *r;
+      }
+    }
+    /* the terminator takes the place of the separator, or of the byte past the
+     * file at the end */
+    if (r != end)
+      ++r;
+    *w++ = '\0';
+    tokens[count++] = token;
+  }
+
+  return count;
+}
+
+static Option const* find_option_lname(OptParser const* parser, char const* str, size_t len, bool* ambiguous) {
+  OptIndex const* index = parser->index;
+  Option const* found = NULL;
+  STATS_ADD(lookups, 1);
+
+  if (index && index->slots) {
+    found = find_option_lname_indexed(index, str, len);
+  } else if (index && index->sorted) {
+    size_t const i = find_option_sorted(index, str, len);
+    if (i < index->n_sorted && compare_name(index->sorted[i]->lname, str, len) == 0)
+      found = index->sorted[i];
+  } else if (parser->keys) {
+    uint64_t const key = name_key(str, len);
+    size_t lo = 0;
+    size_t hi = parser->n_keys;
+    while (lo < hi) {
+      size_t const mid = lo + (hi - lo) / 2;
+      if (parser->keys[mid].key < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (; lo < parser->n_keys && parser->keys[lo].key == key; ++lo) {
+      Option const* opt = parser->order[parser->keys[lo].position];
+      STATS_ADD(compares, 1);
+      if (memcmp(opt->lname, str, len) == 0) {
+        found = opt;
+        break;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+      Option const* opt = parser->order[i];
+      if (!opt->lname)
+        continue;
+      if (compare_name(opt->lname, str, len) == 0) {
+        found = opt;
+        break;
+      }
+    }
+  }
+
+  if (found || !(parser->flags & OPTPARSER_ABBREVIATIONS) || len == 0)
+    return found;
+  return find_option_prefix(parser, str, len, ambiguous);
+}
+
+static size_t find_option_sorted(OptIndex const* index, char const* str, size_t len) {
+  size_t lo = 0;
+  size_t hi = index->n_sorted;
+  while (lo < hi) {
+    size_t const mid = lo + (hi - lo) / 2;
+    if (compare_name(index->sorted[mid]->lname, str, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static Option const* find_option_prefix(OptParser const* parser, char const* str, size_t len, bool* ambiguous) {
+  OptIndex const* index = parser->index;
+
+  if (index && index->sorted) {
+    /* names starting with the prefix directly follow its position */
+    size_t const i = find_option_sorted(index, str, len);
+    STATS_ADD(compares, 2);
+    if (i == index->n_sorted || strncmp(index->sorted[i]->lname, str, len) != 0)
+      return NULL;
+    if (i + 1 < index->n_sorted && strncmp(index->sorted[i + 1]->lname, str, len) == 0) {
+      *ambiguous = true;
+      return NULL;
+    }
+    return index->sorted[i];
+  }
+
+  Option const* found = NULL;
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    if (!opt->lname)
+      continue;
+    STATS_ADD(compares, 1);
+    if (strncmp(opt->lname, str, len) != 0)
+      continue;
+    if (found) {
+      *ambiguous = true;
+      return NULL;
+    }
+    found = opt;
+  }
+  return found;
+}
+
+static int compare_name(char const* lname, char const* str, size_t len) {
+  STATS_ADD(compares, 1);
+  int const cmp = strncmp(lname, str, len);
+  if (cmp != 0)
+    return cmp;
+  return lname[len] ? 1 : 0;
+}
+
+static int compare_lnames(void const* lhs, void const* rhs) {
+  return strcmp((*(Option const* const*)lhs)->lname, (*(Option const* const*)rhs)->lname);
+}
+
+static Option const* find_option_lname_indexed(OptIndex const* index, char const* str, size_t len) {
+  uint32_t const hash = hash_name(str, len);
+  for (size_t i = hash & index->mask; index->slots[i].opt; i = (i + 1) & index->mask) {
+    OptIndexSlot const* slot = &index->slots[i];
+    if (slot->hash != hash || slot->len != len)
+      continue;
+    STATS_ADD(compares, 1);
+    if (memcmp(slot->opt->lname, str, len) == 0)
+      return slot->opt;
+  }
+  return NULL;
+}
+
+static uint32_t hash_name(char const* str, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int index_init(OptIndex* index, size_t count, OptIndexSlot* slots, size_t n_slots) {
+  if (n_slots == 0 || (n_slots & (n_slots - 1)) != 0)
+    return -1;
+  if (count >= n_slots)
+    return -1;
+
+  memset(slots, 0, n_slots * sizeof(*slots));
+  index->slots = slots;
+  index->mask = n_slots - 1;
+  return 0;
+}
+
+static void index_insert(OptIndex* index, Option const* opt) {
+  if (opt->type == OPTION_POSITIONAL || !opt->lname)
+    return;
+  index_insert_name(index, opt, opt->lname);
+}
+
+static void index_insert_name(OptIndex* index, Option const* opt, char const* name) {
+  size_t const len = strlen(name);
+  uint32_t const hash = hash_name(name, len);
+  size_t i = hash & index->mask;
+  while (index->slots[i].opt)
+    i = (i + 1) & index->mask;
+  index->slots[i] = (OptIndexSlot){opt, hash, (uint32_t)len};
+}
+
+static void build_short_table(OptParser* parser) {
+  memset(parser->shorts, 0, sizeof(parser->shorts));
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    unsigned char const c = (unsigned char)opt->sname;
+    /* the first option with a given short name wins, as in a linear scan */
+    if (c && !parser->shorts[c])
+      parser->shorts[c] = opt;
+  }
+}
+
+static void build_required_mask(OptParser* parser, uint64_t* required) {
+  memset(required, 0, (parser->n_options + 63) / 64 * sizeof(*required));
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    if (parser->order[i]->required)
+      bitset_set(required, i);
+  }
+  parser->required = required;
+}
+
+static void build_env_mask(OptParser* parser, uint64_t* envs) {
+  memset(envs, 0, (parser->n_options + 63) / 64 * sizeof(*envs));
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    if (parser->order[i]->env)
+      bitset_set(envs, i);
+  }
+  parser->envs = envs;
+}
+
+static void build_keys(OptParser* parser, OptKey* keys) {
+  size_t n_keys = 0;
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    if (opt->lname)
+      keys[n_keys++] = (OptKey){name_key(opt->lname, strlen(opt->lname)), (uint32_t)i};
+  }
+  sort_keys(keys, n_keys);
+  parser->keys = keys;
+  parser->n_keys = n_keys;
+}
+
+static bool key_less(OptKey const* a, OptKey const* b) {
+  return a->key < b->key || (a->key == b->key && a->position < b->position);
+}
+
+static void sort_keys(OptKey* keys, size_t n) {
+  for (size_t i = n / 2; i-- > 0;)
+    sift_key(keys, i, n);
+  while (n > 1) {
+    OptKey const top = keys[0];
+    keys[0] = keys[--n];
+    keys[n] = top;
+    sift_key(keys, 0, n);
+  }
+}
+
+static void sift_key(OptKey* keys, size_t i, size_t n) {
+  OptKey const key = keys[i];
+  for (size_t child; (child = 2 * i + 1) < n; i = child) {
+    if (child + 1 < n && key_less(&keys[child], &keys[child + 1]))
+      child += 1;
+    if (!key_less(&key, &keys[child]))
+      break;
+    keys[i] = keys[child];
+  }
+  keys[i] = key;
+}
+
+static uint64_t name_key(char const* str, size_t len) { return (uint64_t)len << 32 | hash_name(str, len); }
+
+static void* option_dest(Option const* opt, OptParseState const* state) {
+  if (state->base)
+    return (char*)state->base + opt->offset;
+  return opt->dest;
+}
+
+static int execute_option(OptParser const* parser, Option const* opt, OptParseState* state, char const* token,
+                          char* value, OptParserError* err) {
+  void* const dest = option_dest(opt, state);
+  size_t const position = option_position(parser, opt);
+  assert(opt->type != OPTION_POSITIONAL);
+  switch (opt->type) {
+  case OPTION_STORE_STR:
+  case OPTION_CONFIG:
+    if (!value) {
+      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = token};
+      return -1;
+    }
+    *(char const**)dest = value;
+    break;
+  case OPTION_STORE_INT:
+  case OPTION_STORE_UINT:
+  case OPTION_STORE_SIZE:
+  case OPTION_STORE_DOUBLE:
+    if (!value) {
+      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = token};
+      return -1;
+    }
+    if (store_number(opt, dest, token, value, err) == -1)
+      return -1;
+    break;
+  case OPTION_APPEND_STR:
+  case OPTION_APPEND_INT:
+    if (!value) {
+      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = token};
+      return -1;
+    }
+    if (append_value(opt, position, state, dest, token, value, err) == -1)
+      return -1;
+    break;
+  case OPTION_STORE_INT_LIST:
+    if (!value) {
+      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = token};
+      return -1;
+    }
+    if (store_int_list(position, state, dest, token, value, err) == -1)
+      return -1;
+    break;
+  case OPTION_CALLBACK:
+    if (!value) {
+      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = token};
+      return -1;
+    }
+    assert(opt->convert);
+    STATS_ADD(conversions, 1);
+    if (opt->convert(opt, value, dest) == -1) {
+      *err = (OptParserError){OPTERROR_INVALID_ARGUMENT, .opt = token};
+      return -1;
+    }
+    break;
+  case OPTION_LAZY:
+    if (!value) {
+      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = token};
+      return -1;
+    }
+    *(OptLazy*)dest = (OptLazy){value, opt, OPTLAZY_PENDING};
+    break;
+  case OPTION_FLAG:
+    *(bool*)dest = true;
+    break;
+  case OPTION_INCREMENT:
+    *(int*)dest += 1;
+    break;
+  case OPTION_POSITIONAL:
+    __builtin_unreachable();
+  }
+  bitset_set(state_bits(state), position);
+  return 0;
+}
+
+static int store_number(Option const* opt, void* dest, char const* token, char const* value, OptParserError* err) {
+  NumResult result = NUM_INVALID;
+  OptParserErrorType type_error = OPTERROR_INT_TYPE_ERROR;
+  STATS_ADD(conversions, 1);
+
+  switch (opt->type) {
+  case OPTION_STORE_INT:
+    result = parse_long(value, (long*)dest);
+    break;
+  case OPTION_STORE_UINT: {
+    uint64_t number = 0;
+    type_error = OPTERROR_UINT_TYPE_ERROR;
+    result = parse_unsigned(value, ULONG_MAX, &number);
+    if (result == NUM_OK)
+      *(unsigned long*)dest = (unsigned long)number;
+    break;
+  }
+  case OPTION_STORE_SIZE:
+    type_error = OPTERROR_SIZE_TYPE_ERROR;
+    result = parse_size(value, (uint64_t*)dest);
+    break;
+  case OPTION_STORE_DOUBLE:
+    type_error = OPTERROR_DOUBLE_TYPE_ERROR;
+    result = parse_double(value, (double*)dest);
+    break;
+  case OPTION_POSITIONAL:
+  case OPTION_FLAG:
+  case OPTION_STORE_STR:
+  case OPTION_INCREMENT:
+  case OPTION_APPEND_STR:
+  case OPTION_APPEND_INT:
+  case OPTION_STORE_INT_LIST:
+  case OPTION_CONFIG:
+  case OPTION_CALLBACK:
+  case OPTION_LAZY:
+    __builtin_unreachable();
+  }
+
+  switch (result) {
+  case NUM_OK:
+    return 0;
+  case NUM_INVALID:
+    *err = (OptParserError){type_error, .opt = token};
+    return -1;
+  case NUM_RANGE:
+    *err = (OptParserError){OPTERROR_OUT_OF_RANGE, .opt = token};
+    return -1;
+  }
+  __builtin_unreachable();
+}
+
+static NumResult parse_digits(char const* str, uint64_t max, char const** end, uint64_t* out) {
+  uint64_t value = 0;
+  char const* p = str;
+
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    p += 2;
+    for (;; ++p) {
+      unsigned digit;
+      if (*p >= '0' && *p <= '9')
+        digit = (unsigned)(*p - '0');
+      else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+        digit = (unsigned)((*p | 0x20) - 'a' + 10);
+      else
+        break;
+      if (digit > max || value > (max - digit) >> 4)
+        return NUM_RANGE;
+      value = value << 4 | digit;
+    }
+    if (p == str + 2)
+      return NUM_INVALID;
+  } else {
+    for (; *p >= '0' && *p <= '9'; ++p) {
+      unsigned const digit = (unsigned)(*p - '0');
+      if (digit > max || value > (max - digit) / 10)
+        return NUM_RANGE;
+      value = value * 10 + digit;
+    }
+    if (p == str)
+      return NUM_INVALID;
+  }
+
+  *end = p;
+  *out = value;
+  return NUM_OK;
+}
+
+static NumResult parse_long(char const* str, long* out) {
+  bool const negative = *str == '-';
+  if (*str == '-' || *str == '+')
+    str += 1;
+
+  uint64_t const max = negative ? (uint64_t)LONG_MAX + 1 : (uint64_t)LONG_MAX;
+  uint64_t value = 0;
+  char const* end = NULL;
+  NumResult const result = parse_digits(str, max, &end, &value);
+  if (result != NUM_OK)
+    return result;
+  if (*end != '\0')
+    return NUM_INVALID;
+
+  /* negate in unsigned arithmetic, so LONG_MIN does not overflow */
+  *out = negative ? (long)(0 - value) : (long)value;
+  return NUM_OK;
+}
+
+static NumResult parse_unsigned(char const* str, uint64_t max, uint64_t* out) {
+  char const* end = NULL;
+  NumResult const result = parse_digits(str, max, &end, out);
+  if (result != NUM_OK)
+    return result;
+  return *end == '\0' ? NUM_OK : NUM_INVALID;
+}
+
+static NumResult parse_size(char const* str, uint64_t* out) {
+  uint64_t value = 0;
+  char const* end = NULL;
+  NumResult const result = parse_digits(str, UINT64_MAX, &end, &value);
+  if (result != NUM_OK)
+    return result;
+
+  unsigned shift = 0;
+  switch (*end | 0x20) {
+  case 'k':
+    shift = 10;
+    break;
+  case 'm':
+    shift = 20;
+    break;
+  case 'g':
+    shift = 30;
+    break;
+  case 't':
+    shift = 40;
+    break;
+  default:
+    break;
+  }
+  if (shift)
+    end += 1;
+  if (*end != '\0')
+    return NUM_INVALID;
+  if (value > UINT64_MAX >> shift)
+    return NUM_RANGE;
+
+  *out = value << shift;
+  return NUM_OK;
+}
+
+static NumResult parse_double(char const* str, double* out) {
+  if (parse_double_fast(str, out))
+    return NUM_OK;
+
+  /* without the locale, e.g. out of memory, the global one is used */
+  pthread_once(&c_numeric_once, c_numeric_init);
+  locale_t const previous = c_numeric ? uselocale(c_numeric) : (locale_t)0;
+  char* end = NULL;
+  errno = 0;
+  double const value = strtod(str, &end);
+  int const error = errno;
+  if (previous)
+    uselocale(previous);
+  errno = error;
+  if (end == str || *end != '\0')
+    return NUM_INVALID;
+  if (errno == ERANGE && isinf(value))
+    return NUM_RANGE;
+  *out = value;
+  return NUM_OK;
+}
+
+static bool parse_double_fast(char const* str, double* out) {
+  static double const powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  char const* p = str;
+  bool const negative = *p == '-';
+  if (*p == '-' || *p == '+')
+    p += 1;
+
+  uint64_t mantissa = 0;
+  int n_digits = 0;
+  int exponent = 0;
+  char const* const digits = p;
+
+  for (; *p >= '0' && *p <= '9'; ++p) {
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (n_digits++ == 19)
+      return false;
+    mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+  }
+  if (*p == '.') {
+    for (++p; *p >= '0' && *p <= '9'; ++p) {
+      exponent -= 1;
+      if (mantissa == 0 && *p == '0')
+        continue;
+      if (n_digits++ == 19)
+        return false;
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+    }
+  }
+  if (p == digits || (p == digits + 1 && *digits == '.'))
+    return false;
+
+  if ((*p | 0x20) == 'e') {
+    p += 1;
+    bool const exp_negative = *p == '-';
+    if (*p == '-' || *p == '+')
+      p += 1;
+    if (*p < '0' || *p > '9')
+      return false;
+    int exp_value = 0;
+    for (; *p >= '0' && *p <= '9'; ++p) {
+      if (exp_value > 1000)
+        return false;
+      exp_value = exp_value * 10 + (*p - '0');
+    }
+    exponent += exp_negative ? -exp_value : exp_value;
+  }
+  if (*p != '\0' || mantissa > (uint64_t)1 << 53 || exponent < -22 || exponent > 22)
+    return false;
+
+  double value = (double)mantissa;
+  if (exponent < 0)
+    value /= powers[-exponent];
+  else
+    value *= powers[exponent];
+  *out = negative ? -value : value;
+  return true;
+}
+
+static int append_value(Option const* opt, size_t position, OptParseState* state, void* dest, char const* token,
+                        char* value, OptParserError* err) {
+  bool const fresh = !bitset_test(state_bits(state), position);
+
+  if (opt->type == OPTION_APPEND_STR) {
+    OptStrList* list = dest;
+    if (fresh)
+      *list = (OptStrList){0};
+    char const** items = arena_reserve(state, list->items, list->count, &list->capacity, 1, sizeof(*list->items));
+    if (!items) {
+      *err = (OptParserError){arena_error(state), .opt = token};
+      return -1;
+    }
+    items[list->count++] = value;
+    list->items = items;
+    return 0;
+  }
+
+  long number = 0;
+  STATS_ADD(conversions, 1);
+  NumResult const result = parse_long(value, &number);
+  if (result != NUM_OK) {
+    *err = (OptParserError){result == NUM_RANGE ? OPTERROR_OUT_OF_RANGE : OPTERROR_INT_TYPE_ERROR, .opt = token};
+    return -1;
+  }
+
+  OptIntList* list = dest;
+  if (fresh)
+    *list = (OptIntList){0};
+  long* items = arena_reserve(state, list->items, list->count, &list->capacity, 1, sizeof(*list->items));
+  if (!items) {
+    *err = (OptParserError){arena_error(state), .opt = token};
+    return -1;
+  }
+  items[list->count++] = number;
+  list->items = items;
+  return 0;
+}
+
+static void* arena_reserve(OptParseState* state, void* items, size_t count, size_t* capacity, size_t n,
+                           size_t item_size) {
+  size_t const needed = count + n;
+  if (needed <= *capacity)
+    return items;
+
+  size_t const available = state->arena_size - state->arena_used;
+  size_t wanted = count * 2 > needed ? count * 2 : needed;
+  if (wanted < 8)
+    wanted = 8;
+
+  /* the array is the last allocation */
+  if (items && (char*)items + *capacity * item_size == state->arena + state->arena_used) {
+    size_t const max_capacity = *capacity + available / item_size;
+    if (max_capacity < needed)
+      return NULL;
+    size_t const new_capacity = wanted < max_capacity ? wanted : max_capacity;
+    state->arena_used += (new_capacity - *capacity) * item_size;
+    *capacity = new_capacity;
+    return items;
+  }
+
+  if (!state->arena)
+    return NULL;
+  /* the arena itself may be unaligned */
+  size_t const misalign = (size_t)((uintptr_t)(state->arena + state->arena_used) % item_size);
+  size_t const pad = (item_size - misalign) % item_size;
+  if (available < pad)
+    return NULL;
+  size_t const fits = (available - pad) / item_size;
+  if (fits < needed)
+    return NULL;
+  size_t const new_capacity = wanted < fits ? wanted : fits;
+
+  char* const moved = state->arena + state->arena_used + pad;
+  if (count)
+    memcpy(moved, items, count * item_size);
+  state->arena_used += pad + new_capacity * item_size;
+  *capacity = new_capacity;
+  return moved;
+}
+
+static int store_int_list(size_t position, OptParseState* state, void* dest, char const* token, char const* value,
+                          OptParserError* err) {
+  OptIntList* list = dest;
+  if (!bitset_test(state_bits(state), position))
+    *list = (OptIntList){0};
+
+  size_t const len = strlen(value);
+  char const* const limit = value + len;
+  size_t n_items = 1;
+  for (char const* p = value; (p = memchr(p, ',', (size_t)(limit - p))); ++p)
+    n_items += 1;
+
+  long* items = arena_reserve(state, list->items, list->count, &list->capacity, n_items, sizeof(*list->items));
+  if (!items) {
+    *err = (OptParserError){arena_error(state), .opt = token};
+    return -1;
+  }
+  list->items = items;
+  STATS_ADD(conversions, n_items);
+
+  char const* p = value;
+  for (size_t i = 0; i < n_items; ++i) {
+    char const* end = p;
+    NumResult result = parse_list_item(p, limit, &end, &items[list->count + i]);
+    if (result == NUM_OK && *end != ',' && *end != '\0')
+      result = NUM_INVALID;
+    if (result != NUM_OK) {
+      OptParserErrorType const type = result == NUM_RANGE ? OPTERROR_OUT_OF_RANGE : OPTERROR_INT_LIST_TYPE_ERROR;
+      *err = (OptParserError){type, .opt = token, .column = (size_t)(end - value) + 1};
+      return -1;
+    }
+    p = end + 1;
+  }
+
+  list->count += n_items;
+  return 0;
+}
+
+static NumResult parse_list_item(char const* str, char const* limit, char const** end, long* out) {
+  char const* p = str;
+  bool const negative = *p == '-';
+  if (*p == '-' || *p == '+')
+    p += 1;
+
+  uint64_t const max = negative ? (uint64_t)LONG_MAX + 1 : (uint64_t)LONG_MAX;
+  uint64_t value = 0;
+  char const* const digits = p;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  /* validate and convert eight digits at a time with SWAR arithmetic */
+  while (limit - p >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, p, sizeof(chunk));
+    if (((chunk & 0xF0F0F0F0F0F0F0F0) | (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) !=
+        0x3333333333333333)
+      break;
+    chunk = (chunk & 0x0F0F0F0F0F0F0F0F) * 2561 >> 8;
+    chunk = (chunk & 0x00FF00FF00FF00FF) * 6553601 >> 16;
+    chunk = (chunk & 0x0000FFFF0000FFFF) * 42949672960001 >> 32;
+    if (value > (max - chunk) / 100000000) {
+      *end = str;
+      return NUM_RANGE;
+    }
+    value = value * 100000000 + chunk;
+    p += 8;
+  }
+#else
+  (void)limit;
+#endif
+
+  for (; *p >= '0' && *p <= '9'; ++p) {
+    unsigned const digit = (unsigned)(*p - '0');
+    if (value > (max - digit) / 10) {
+      *end = str;
+      return NUM_RANGE;
+    }
+    value = value * 10 + digit;
+  }
+
+  *end = p;
+  if (p == digits)
+    return NUM_INVALID;
+
+  *out = negative ? (long)(0 - value) : (long)value;
+  return NUM_OK;
+}
+
+static Option const* store_positional(OptParser const* parser, OptParseState* state, char* value) {
+  if (state->pos_count == parser->n_positionals)
+    return NULL;
+  Option const* pos = parser->order[parser->n_options - parser->n_positionals + state->pos_count];
+  *(char const**)option_dest(pos, state) = value;
+  state->pos_count += 1;
+  return pos;
+}
+
+static void reset_state(OptParser const* parser, OptParseState* state) {
+  optparse_state_release(state);
+  clear_state(parser, state);
+}
+
+static uint64_t* state_bits(OptParseState* state) { return state->bits ? state->bits : state->activated; }
+
+static bool state_fits(OptParser const* parser, OptParseState const* state) {
+  return (parser->n_options + 63) / 64 <= (state->bits ? state->bits_words : OPT_BITSET_WORDS);
+}
+
+static void clear_state(OptParser const* parser, OptParseState* state) {
+  memset(state_bits(state), 0, (parser->n_options + 63) / 64 * sizeof(*state_bits(state)));
+  state->pos_count = 0;
+  state->arena_used = 0;
+  state->n_errors = 0;
+}
+
+static int apply_env(OptParser const* parser, OptParseState* state, OptParserError* err) {
+  size_t const n_flags = parser->n_options - parser->n_positionals;
+  uint64_t const* activated = state_bits(state);
+  OptIndexSlot slots[2 * OPT_MAX_ENV_OPTIONS];
+  OptIndex index = {0};
+  size_t count = 0;
+
+  for (size_t w = 0; w < (n_flags + 63) / 64; ++w) {
+    uint64_t bits = ~activated[w];
+    if (parser->envs)
+      bits &= parser->envs[w];
+    if (w == n_flags / 64)
+      bits &= ((uint64_t)1 << (n_flags % 64)) - 1;
+    for (; bits; bits &= bits - 1) {
+      Option const* opt = parser->order[w * 64 + (size_t)__builtin_ctzll(bits)];
+      if (!opt->env)
+        continue;
+      if (count == OPT_MAX_ENV_OPTIONS) {
+        char* value = getenv(opt->env);
+        if (value && apply_env_value(parser, opt, state, value, err) == -1)
+          return -1;
+        continue;
+      }
+      if (count++ == 0)
+        index_init(&index, 0, slots, sizeof(slots) / sizeof(*slots));
+      index_insert_name(&index, opt, opt->env);
+    }
+  }
+  if (count == 0)
+    return 0;
+
+  for (char** var = environ; *var; ++var) {
+    char* eq = strchr(*var, '=');
+    if (!eq)
+      continue;
+    size_t const len = (size_t)(eq - *var);
+    uint32_t const hash = hash_name(*var, len);
+    STATS_ADD(lookups, 1);
+    /* several options may share a variable */
+    for (size_t i = hash & index.mask; slots[i].opt; i = (i + 1) & index.mask) {
+      OptIndexSlot const* slot = &slots[i];
+      if (slot->hash != hash || slot->len != len)
+        continue;
+      STATS_ADD(compares, 1);
+      if (memcmp(slot->opt->env, *var, len) == 0 && apply_env_value(parser, slot->opt, state, eq + 1, err) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static int apply_env_value(OptParser const* parser, Option const* opt, OptParseState* state, char* value,
+                           OptParserError* err) {
+  /* the first of repeated variables wins, as with getenv */
+  if (bitset_test(state_bits(state), option_position(parser, opt)))
+    return 0;
+  if (!opt_has_argument(opt)) {
+    if (!is_enabling(value))
+      return 0;
+    value = NULL;
+  }
+  if (execute_option(parser, opt, state, opt->env, value, err) == -1)
+    return report_error(state, err, 0);
+  return 0;
+}
+
+static int apply_config(OptParser const* parser, OptParseState* state, OptParserError* err) {
+  Option const* config = parser->config;
+  char const* path = *(char const**)option_dest(config, state);
+  if (!path)
+    return 0;
+
+  *err = (OptParserError){OPTERROR_CONFIG_FILE, .opt = path};
+  if (state->n_maps == OPT_MAX_RESPONSE_FILES)
+    return -1;
+
+  size_t size = 0;
+  int const fd = open_file(path, &size);
+  if (fd == -1) {
+    /* a default path is optional */
+    if (errno == ENOENT && !bitset_test(state_bits(state), option_position(parser, config))) {
+      *err = (OptParserError){0};
+      return 0;
+    }
+    return -1;
+  }
+  size_t const data_len = map_data_len(size);
+  char* data = map_file(state, fd, size, data_len);
+  if (!data)
+    return -1;
+
+  *err = (OptParserError){0};
+  return parse_config(parser, state, data, size, path, err);
+}
+
+static int parse_config(OptParser const* parser, OptParseState* state, char* data, size_t size, char const* path,
+                        OptParserError* err) {
+  /* options activated by the config itself are still overridden by later
+   * lines, like repeated arguments */
+  uint64_t given[(parser->n_options + 63) / 64];
+  memcpy(given, state_bits(state), sizeof(given));
+
+  char* p = data;
+  char* const end = data + size;
+  for (size_t line = 1; p < end; ++line) {
+    char* eol = memchr(p, '\n', (size_t)(end - p));
+    if (!eol)
+      eol = end;
+    char* const next = eol + 1;
+
+    while (p < eol && is_blank(*p))
+      ++p;
+    if (p == eol || *p == '#') {
+      p = next;
+      continue;
+    }
+
+    char* const key = p;
+    while (p < eol && *p != '=' && !is_blank(*p))
+      ++p;
+    size_t const key_len = (size_t)(p - key);
+    while (p < eol && is_blank(*p))
+      ++p;
+    if (p == eol || *p != '=' || key_len == 0) {
+      *err = (OptParserError){OPTERROR_CONFIG_SYNTAX, .opt = path, .line = line};
+      return -1;
+    }
+    ++p;
+
+    while (p < eol && is_blank(*p))
+      ++p;
+    char* value = p;
+    char* value_end = eol;
+    while (value_end > value && is_blank(value_end[-1]))
+      --value_end;
+    if (value_end - value >= 2 && (*value == '"' || *value == '\'') && value_end[-1] == *value) {
+      ++value;
+      --value_end;
+    }
+    /* the key is followed by a space or `=`, the value by a newline, a
+     * space, a quote or the byte past the file */
+    key[key_len] = '\0';
+    *value_end = '\0';
+    p = next;
+
+    bool ambiguous = false;
+    Option const* opt = find_option_lname(parser, key, key_len, &ambiguous);
+    if (!opt || compare_name(opt->lname, key, key_len) != 0) {
+      *err = (OptParserError){OPTERROR_UNKNOWN, .opt = key, .line = line,
+                              .suggestion = suggest_lname(parser, key, key_len)};
+      if (report_error(state, err, 0) == -1)
+        return -1;
+      continue;
+    }
+    if (opt == parser->config || bitset_test(given, option_position(parser, opt)))
+      continue;
+
+    if (!opt_has_argument(opt)) {
+      if (!is_enabling(value))
+        continue;
+      value = NULL;
+    }
+    if (execute_option(parser, opt, state, key, value, err) == -1) {
+      err->line = line;
+      if (report_error(state, err, 0) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static bool is_enabling(char const* value) {
+  return value[0] && strcmp(value, "0") != 0 && strcmp(value, "false") != 0 && strcmp(value, "no") != 0 &&
+         strcmp(value, "off") != 0;
+}
+
+static int check_complete(OptParser const* parser, OptParseState* state, OptParserError* err) {
+  size_t const n_flags = parser->n_options - parser->n_positionals;
+  uint64_t const* activated = state_bits(state);
+
+  for (size_t i = state->pos_count; i < parser->n_positionals; ++i) {
+    *err = (OptParserError){OPTERROR_EXPECTED_POSITIONAL, .opt = parser->order[n_flags + i]->lname};
+    if (report_error(state, err, 0) == -1)
+      return -1;
+  }
+
+  if (parser->required) {
+    for (size_t w = 0; w < (n_flags + 63) / 64; ++w) {
+      for (uint64_t bits = parser->required[w] & ~activated[w]; bits; bits &= bits - 1) {
+        Option const* missing = parser->order[w * 64 + (size_t)__builtin_ctzll(bits)];
+        *err = (OptParserError){OPTERROR_REQUIRED_OPTION, .lname = missing->lname, .sname = missing->sname};
+        if (report_error(state, err, 0) == -1)
+          return -1;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < n_flags; ++i) {
+      Option const* missing = parser->order[i];
+      if (missing->required && !bitset_test(activated, i)) {
+        *err = (OptParserError){OPTERROR_REQUIRED_OPTION, .lname = missing->lname, .sname = missing->sname};
+        if (report_error(state, err, 0) == -1)
+          return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int report_error(OptParseState* state, OptParserError* err, int index) {
+  err->index = index;
+  if (!state->errors || !is_recoverable(err->type))
+    return -1;
+  collect_error(state, err);
+  return 0;
+}
+
+static bool is_recoverable(OptParserErrorType type) {
+  switch (type) {
+  case OPTERROR_UNKNOWN:
+  case OPTERROR_UNEXPECTED_POSITIONAL:
+  case OPTERROR_EXPECTED_POSITIONAL:
+  case OPTERROR_ARGUMENT_REQUIRED:
+  case OPTERROR_REQUIRED_OPTION:
+  case OPTERROR_INT_TYPE_ERROR:
+  case OPTERROR_UINT_TYPE_ERROR:
+  case OPTERROR_SIZE_TYPE_ERROR:
+  case OPTERROR_DOUBLE_TYPE_ERROR:
+  case OPTERROR_OUT_OF_RANGE:
+  case OPTERROR_INT_LIST_TYPE_ERROR:
+  case OPTERROR_AMBIGUOUS:
+  case OPTERROR_UNEXPECTED_ARGUMENT:
+  case OPTERROR_INVALID_ARGUMENT:
+    return true;
+  case OPTERROR_NOERR:
+  case OPTERROR_ONE_ARG_OPT_PER_GROUP:
+  case OPTERROR_TOO_MANY_OPTIONS:
+  case OPTERROR_RESPONSE_FILE:
+  case OPTERROR_ARENA_FULL:
+  case OPTERROR_EXPECTED_COMMAND:
+  case OPTERROR_UNKNOWN_COMMAND:
+  case OPTERROR_CONFIG_FILE:
+  case OPTERROR_CONFIG_SYNTAX:
+  case OPTERROR_SNAPSHOT:
+  case OPTERROR_NO_ARENA:
+  case OPTERROR_NO_CONVERTER:
+  case OPTERROR_TOKEN_SOURCE:
+  default:
+    return false;
+  }
+}
+
+static void collect_error(OptParseState* state, OptParserError const* err) {
+  if (state->n_errors < state->errors_capacity)
+    state->errors[state->n_errors] = *err;
+  state->n_errors += 1;
+}
+
+static int finish_errors(OptParseState* state, int ret, OptParserError* err) {
+  if (!state->errors)
+    return ret;
+  if (ret == -1)
+    collect_error(state, err);
+  if (state->n_errors == 0)
+    return 0;
+  if (state->errors_capacity > 0)
+    *err = state->errors[0];
+  return -1;
+}
+
+static bool opt_has_argument(Option const* opt) {
+  switch (opt->type) {
+  case OPTION_STORE_STR:
+  case OPTION_STORE_INT:
+  case OPTION_STORE_UINT:
+  case OPTION_STORE_SIZE:
+  case OPTION_STORE_DOUBLE:
+  case OPTION_APPEND_STR:
+  case OPTION_APPEND_INT:
+  case OPTION_STORE_INT_LIST:
+  case OPTION_CONFIG:
+  case OPTION_CALLBACK:
+  case OPTION_LAZY:
+    return true;
+  case OPTION_POSITIONAL:
+  case OPTION_FLAG:
+  case OPTION_INCREMENT:
+  default:
+    return false;
+  }
+}
+
+static void print_option_names(Option const* opt, OptBuf* buf) {
+  assert(opt->sname || opt->lname);
+  if (opt->sname) {
+    buf_putc(buf, '-');
+    buf_putc(buf, opt->sname);
+  }
+  if (opt->sname && opt->lname)
+    buf_putc(buf, '|');
+  if (opt->lname) {
+    buf_puts(buf, "--");
+    buf_puts(buf, opt->lname);
+  }
+}
+
+static void print_option_bare(Option const* opt, OptBuf* buf) {
+  switch (opt->type) {
+
+  case OPTION_POSITIONAL:
+    assert(opt->lname || opt->metavar);
+    buf_puts(buf, opt->metavar ? opt->metavar : opt->lname);
+    break;
+
+  case OPTION_FLAG:
+    /* fallthrough */
+
+  case OPTION_INCREMENT:
+    print_option_names(opt, buf);
+    break;
+
+  case OPTION_STORE_STR:
+    /* fallthrough */
+
+  case OPTION_STORE_INT:
+    /* fallthrough */
+
+  case OPTION_STORE_UINT:
+    /* fallthrough */
+
+  case OPTION_STORE_SIZE:
+    /* fallthrough */
+
+  case OPTION_STORE_DOUBLE:
+    /* fallthrough */
+
+  case OPTION_APPEND_STR:
+    /* fallthrough */
+
+  case OPTION_APPEND_INT:
+    /* fallthrough */
+
+  case OPTION_STORE_INT_LIST:
+    /* fallthrough */
+
+  case OPTION_CONFIG:
+    /* fallthrough */
+
+  case OPTION_CALLBACK:
+    /* fallthrough */
+
+  case OPTION_LAZY:
+    print_option_names(opt, buf);
+    buf_putc(buf, ' ');
+    if (opt->metavar)
+      buf_puts(buf, opt->metavar);
+    else if (opt->lname)
+      buf_puts(buf, opt->lname);
+    else
+      buf_putc(buf, opt->sname);
+    break;
+  }
+}
 
-#include "optparse.h"
+static int parse_short_opts(OptParser const* parser, OptParseState* state, char* group, int index,
+                            OptArgvSource* args, OptParserError* err) {
+  bool const group_arguments = parser->flags & OPTPARSER_GROUP_ARGUMENTS;
 
-/* Collect positional options into an option list
- *
- * Internally it does not "collect" options into a separate list, instead it
- * repartitions the existing list, connecting positionals to positionals
- * and non-positionals to non-positionals, and then places positionals at the
- * end of the list.
- */
-static int collect_positionals(OptionList* pos, OptionList const* opts);
+  for (size_t i = 1; group[i]; ++i) {
+    STATS_ADD(lookups, 1);
+    Option const* opt = parser->shorts[(unsigned char)group[i]];
+    if (!opt) {
+      *err = (OptParserError){OPTERROR_UNKNOWN, .opt = group, .sname = group[i]};
+      if (report_error(state, err, index) == -1)
+        return -1;
+      continue;
+    }
+    char* value = NULL;
+    if (opt_has_argument(opt)) {
+      if (group[i + 1] && !group_arguments) {
+        if (execute_option(parser, opt, state, group, group + i + 1, err) == -1)
+          return report_error(state, err, index);
+        return 0;
+      }
+      value = opt_argv_source(args);
+    }
+    if (execute_option(parser, opt, state, group, value, err) == -1 && report_error(state, err, index) == -1)
+      return -1;
+  }
 
-/* Find an option by its long name */
-static Option* find_option_lname(OptionList const* opts, char const* str);
+  return 0;
+}
 
-/* Find an option by its short name */
-static Option* find_option_sname(OptionList const* opts, char const* str);
+static void bitset_set(uint64_t* bits, size_t idx) { bits[idx / 64] |= (uint64_t)1 << (idx % 64); }
 
-/* Assign a value to an option */
-static int execute_option(Option* opt, int idx, int argc, char** argv, OptParserError* err);
+static bool bitset_test(uint64_t const* bits, size_t idx) { return (bits[idx / 64] >> (idx % 64)) & 1; }
 
-/* Check if an option requires an argument */
-static bool opt_has_argument(Option const* opt);
+static void print_option(Option const* opt, OptBuf* buf) {
+  if (!opt->required && opt->type != OPTION_POSITIONAL)
+    buf_putc(buf, '[');
+  print_option_bare(opt, buf);
+  if (!opt->required && opt->type != OPTION_POSITIONAL)
+    buf_putc(buf, ']');
 
-/* Parse short options group */
-static int parse_short_opts(OptionList* opts, int idx, int argc, char** argv, int* omit_idx, OptParserError* err);
+  buf_putc(buf, ' ');
+}
 
-static int print_option(Option const* opt, FILE* fout);
-static int print_option_bare(Option const* opt, FILE* fout);
-static int print_option_names(Option const* opt, FILE* fout);
+static int parse_argv(OptParser const* parser, OptParseState* state, int argc, char** argv, OptParserError* err) {
+  if (!state_fits(parser, state)) {
+    optparse_state_release(state);
+    *err = (OptParserError){.type = OPTERROR_TOO_MANY_OPTIONS};
+    return -1;
+  }
+  reset_state(parser, state);
+  state->tail = argc;
 
-int parse_opts(OptionList* opts, int argc, char** argv, OptParserError* err) {
-  assert(opts);
-  assert(argv);
-  assert(err);
+  int ret = parse_args(parser, state, 1, argc, argv, 0, err);
+  if (ret == 0)
+    ret = apply_env(parser, state, err);
+  if (ret == 0 && parser->config)
+    ret = apply_config(parser, state, err);
+  STATS_LAP(parse_ns);
+  if (ret == 0) {
+    ret = check_complete(parser, state, err);
+    STATS_LAP(check_ns);
+  }
+  return finish_errors(state, ret, err);
+}
 
-  OptionList positionals;
-  int const n_pos = collect_positionals(&positionals, opts);
-  int pos_count = 0;
+#if defined(OPT_STATS)
+static void stats_begin(OptParseState* state, bool reset) {
+  if (reset)
+    state->stats = (OptStats){0};
+  current_stats = &state->stats;
+  phase_start = stats_now();
+}
 
-  int omit_idx = -1;
+static void stats_lap(uint64_t* phase_ns) {
+  uint64_t const now = stats_now();
+  *phase_ns += now - phase_start;
+  phase_start = now;
+}
 
-  for (int i = 1; i < argc; ++i) {
-    if (i == omit_idx)
-      continue;
+static void stats_end(bool report) {
+  if (report && stats_hook)
+    stats_hook(current_stats, stats_hook_ctx);
+  current_stats = NULL;
+}
 
-    if (argv[i][0] == '-' && argv[i][1] == '-') {
-      Option* opt = find_option_lname(opts, argv[i] + 2);
-      if (!opt) {
-        *err = (OptParserError){OPTERROR_UNKNOWN, .opt = argv[i]};
-        return -1;
-      }
-      if (execute_option(opt, i, argc, argv, err) == -1)
-        return -1;
-      if (opt_has_argument(opt))
-        omit_idx = i + 1;
+static uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
 
-    } else if (argv[i][0] == '-') {
-      if (parse_short_opts(opts, i, argc, argv, &omit_idx, err) == -1)
-        return -1;
+static void complete_words(OptParser const* parser, OptCommand const* commands, size_t n_commands, char** words,
+                           int n_words, int idx, OptBuf* buf) {
+  bool options_done = false;
+  size_t n_positionals = 0;
+  char const* owner = NULL;
+  size_t pending = 0;
+  size_t taken = 0;
 
+  for (int i = 1; i < idx; ++i) {
+    char const* word = words[i];
+    if (pending) {
+      pending -= 1;
+      taken += 1;
+    } else if (!options_done && strcmp(word, "--") == 0) {
+      options_done = true;
+    } else if (!options_done && word[0] == '-' && word[1]) {
+      token_value_option(parser, word, 0, &pending);
+      owner = word;
+      taken = 0;
+    } else if (n_positionals < parser->n_positionals) {
+      n_positionals += 1;
     } else {
-      if (pos_count == n_pos) {
-        *err = (OptParserError){OPTERROR_UNEXPECTED_POSITIONAL, .opt = argv[i]};
-        return -1;
+      for (size_t c = 0; c < n_commands; ++c) {
+        if (strcmp(commands[c].name, word) != 0)
+          continue;
+        OptParseState state;
+        optparse_state_init(&state, NULL);
+        OptParser const* command_parser = commands[c].setup(&commands[c], &state);
+        if (command_parser)
+          complete_words(command_parser, NULL, 0, words + i, n_words - i, idx - i, buf);
+        return;
       }
-      assert(positionals.start);
-      *(char const**)positionals.start->dest = argv[i];
-      positionals.start = positionals.start->_next;
-      pos_count += 1;
     }
   }
 
-  if (pos_count < n_pos) {
-    Option* pos = positionals.start;
-    while (pos_count != n_pos && pos->_next != NULL) {
-      pos_count += 1;
-      pos = pos->_next;
-    }
-    *err = (OptParserError){OPTERROR_EXPECTED_POSITIONAL, .opt = pos->lname};
-    return -1;
+  if (pending) {
+    size_t count = 0;
+    complete_value(token_value_option(parser, owner, taken, &count), buf);
+    return;
   }
 
-  OPTLIST_FOREACH(opts, opt) {
-    if (opt->type == OPTION_POSITIONAL)
-      break;
-    if (opt->required && !opt->_activated) {
-      err->type = OPTERROR_REQUIRED_OPTION;
-      if (opt->lname)
-        err->lname = opt->lname;
-      if (opt->sname)
-        err->sname = opt->sname;
-      return -1;
+  char const* const cur = idx < n_words ? words[idx] : "";
+  if (options_done) {
+    return;
+  } else if (cur[0] == '-' && cur[1] == '-') {
+    char const* eq = strchr(cur + 2, '=');
+    if (!eq) {
+      complete_long(parser, cur + 2, strlen(cur + 2), buf);
+      return;
+    }
+    bool ambiguous = false;
+    Option const* opt = find_option_lname(parser, cur + 2, (size_t)(eq - cur - 2), &ambiguous);
+    if (opt && opt_has_argument(opt))
+      complete_value(opt, buf);
+  } else if (cur[0] == '-' && !cur[1]) {
+    for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+      if (parser->order[i]->sname)
+        print_completion_name(parser->order[i], false, buf, '\n');
+    }
+    complete_long(parser, "", 0, buf);
+  } else if (cur[0] != '-') {
+    size_t const len = strlen(cur);
+    for (size_t c = 0; c < n_commands; ++c) {
+      if (strncmp(commands[c].name, cur, len) == 0) {
+        buf_puts(buf, commands[c].name);
+        buf_putc(buf, '\n');
+      }
     }
   }
-
-  return 0;
 }
 
-void print_usage(OptionList* opts, FILE* fout, char const* progname) {
-  assert(opts);
-  assert(fout);
-
-  /* collect_positionals is called in parse_opts and that should be enough,
-   * but this is for the case if the user calls print_usage without parsing
-   * options */
-  OptionList positionals;
-  collect_positionals(&positionals, opts);
-
-  char const* last_slash = strrchr(progname, '/');
-  if (last_slash) {
-    fprintf(fout, "%s ", last_slash + 1);
-  } else {
-    fprintf(fout, "%s ", progname);
+static void complete_long(OptParser const* parser, char const* prefix, size_t len, OptBuf* buf) {
+  OptIndex const* index = parser->index;
+  if (index && index->sorted) {
+    for (size_t i = find_option_sorted(index, prefix, len);
+         i < index->n_sorted && strncmp(index->sorted[i]->lname, prefix, len) == 0; ++i)
+      print_completion_name(index->sorted[i], true, buf, '\n');
+    return;
   }
 
-  OPTLIST_FOREACH(opts, opt) {
-    if (opt->type == OPTION_POSITIONAL)
-      break;
-    print_option(opt, fout);
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    if (opt->lname && strncmp(opt->lname, prefix, len) == 0)
+      print_completion_name(opt, true, buf, '\n');
   }
+}
 
-  OPTLIST_FOREACH(&positionals, opt) { print_option(opt, fout); }
-
-  fprintf(fout, "\n");
+static void complete_value(Option const* opt, OptBuf* buf) {
+  buf_putc(buf, ':');
+  if (opt->metavar)
+    buf_puts(buf, opt->metavar);
+  else if (opt->lname)
+    buf_puts(buf, opt->lname);
+  else
+    buf_putc(buf, opt->sname);
+  buf_putc(buf, '\n');
 }
 
-void print_help(OptionList* opts, FILE* fout) {
-  assert(opts);
-  assert(fout);
+static Option const* token_value_option(OptParser const* parser, char const* token, size_t k, size_t* count) {
+  Option const* found = NULL;
+  *count = 0;
 
-  /* collect_positionals is called in parse_opts and that should be enough,
-   * but this is for the case if the user calls print_help without parsing
-   * options or calling print_usage */
-  OptionList positionals;
-  collect_positionals(&positionals, opts);
+  if (token[1] == '-') {
+    bool ambiguous = false;
+    Option const* opt = find_option_lname(parser, token + 2, strlen(token + 2), &ambiguous);
+    if (opt && opt_has_argument(opt) && !strchr(token, '=')) {
+      *count = 1;
+      found = k == 0 ? opt : NULL;
+    }
+    return found;
+  }
 
-  OPTLIST_FOREACH(opts, opt) {
-    int opt_column_len = 0;
-    opt_column_len += fprintf(fout, "  ");
-    opt_column_len += print_option_bare(opt, fout);
-    if (opt->help) {
-      if (opt_column_len >= OPT_COLUMN_WIDTH) {
-        fprintf(fout, "\n%*s", OPT_COLUMN_WIDTH, " ");
-      } else {
-        fprintf(fout, "%*s", OPT_COLUMN_WIDTH - opt_column_len, " ");
+  for (size_t i = 1; token[i]; ++i) {
+    Option const* opt = parser->shorts[(unsigned char)token[i]];
+    if (!opt)
+      break;
+    if (!opt_has_argument(opt))
+      continue;
+    if (!(parser->flags & OPTPARSER_GROUP_ARGUMENTS)) {
+      /* the rest of the group is the argument */
+      if (!token[i + 1] && k == 0) {
+        *count = 1;
+        found = opt;
       }
-      fprintf(fout, "%s\n", opt->help);
+      break;
     }
+    if (*count == k)
+      found = opt;
+    *count += 1;
   }
+  return found;
 }
 
-char const* opterror_type_to_str(OptParserErrorType err_type) {
-  switch (err_type) {
-  case OPTERROR_NOERR:
-    return "no error";
-  case OPTERROR_UNKNOWN:
-    return "unknown option";
-  case OPTERROR_UNEXPECTED_POSITIONAL:
-    return "unexpected positional argument";
-  case OPTERROR_EXPECTED_POSITIONAL:
-    return "expected a positional argument";
-  case OPTERROR_ARGUMENT_REQUIRED:
-    return "option requires an argument";
-  case OPTERROR_REQUIRED_OPTION:
-    return "option required";
-  case OPTERROR_ONE_ARG_OPT_PER_GROUP:
-    return "one argument option allowed per short option group";
-  case OPTERROR_INT_TYPE_ERROR:
-    return "required argument of type int";
-  default:
-    __builtin_unreachable();
+static void print_completion_name(Option const* opt, bool lname, OptBuf* buf, char sep) {
+  if (lname) {
+    buf_puts(buf, "--");
+    buf_puts(buf, opt->lname);
+  } else {
+    buf_putc(buf, '-');
+    buf_putc(buf, opt->sname);
   }
+  if (sep)
+    buf_putc(buf, sep);
 }
 
-void print_error(OptParserError* err, FILE* fout) {
-  assert(err);
-  assert(fout);
-
-  fprintf(fout, "%s: ", opterror_type_to_str(err->type));
-
-  if (err->opt) {
-    fprintf(fout, "%s ", err->opt);
-    if (!err->sname && !err->lname) {
-      fprintf(fout, "\n");
-      return;
-    }
+static void build_length_buckets(OptParser* parser, uint32_t* by_length) {
+  size_t const n_flags = parser->n_options - parser->n_positionals;
+  memset(parser->length_start, 0, sizeof(parser->length_start));
+  for (size_t i = 0; i < parser->n_keys; ++i) {
+    size_t const len = (size_t)(parser->keys[i].key >> 32);
+    if (len <= OPT_SUGGEST_MAX_LEN)
+      parser->length_start[len + 1] += 1;
   }
+  for (size_t len = 0; len <= OPT_SUGGEST_MAX_LEN; ++len)
+    parser->length_start[len + 1] += parser->length_start[len];
 
-  if (err->sname) {
-    fprintf(fout, "-%c", err->sname);
-    if (err->lname)
-      fprintf(fout, "|");
+  uint32_t next[OPT_SUGGEST_MAX_LEN + 1];
+  memcpy(next, parser->length_start, sizeof(next));
+  for (size_t i = 0; i < n_flags; ++i) {
+    Option const* opt = parser->order[i];
+    size_t const len = opt->lname ? strlen(opt->lname) : 0;
+    if (opt->lname && len <= OPT_SUGGEST_MAX_LEN)
+      by_length[next[len]++] = (uint32_t)i;
   }
+  parser->by_length = by_length;
+}
 
-  if (err->lname)
-    fprintf(fout, "--%s", err->lname);
+static char const* suggest_lname(OptParser const* parser, char const* str, size_t len) {
+  if (len == 0 || len > OPT_SUGGEST_MAX_LEN)
+    return NULL;
 
-  fprintf(fout, "\n");
-}
+  /* a short name is within a couple of edits of too many others */
+  size_t const bound = len / 3 < OPT_SUGGEST_DISTANCE ? len / 3 + 1 : OPT_SUGGEST_DISTANCE;
+  Option const* best = NULL;
+  size_t best_dist = bound + 1;
 
-static int collect_positionals(OptionList* pos, OptionList const* opts) {
-  pos->start = pos->end = NULL;
-  Option* last_n = NULL;
-  int count = 0;
-  OPTLIST_FOREACH(opts, i) {
-    if (i->type == OPTION_POSITIONAL) {
-      if (!pos->end) {
-        pos->start = pos->end = i;
-      } else {
-        pos->end = pos->end->_next = i;
+  if (!parser->by_length) {
+    for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+      Option const* opt = parser->order[i];
+      if (!opt->lname)
+        continue;
+      size_t const opt_len = strlen(opt->lname);
+      if (opt_len > OPT_SUGGEST_MAX_LEN || (opt_len > len ? opt_len - len : len - opt_len) >= best_dist)
+        continue;
+      STATS_ADD(compares, 1);
+      size_t const dist = edit_distance(opt->lname, opt_len, str, len, best_dist - 1);
+      if (dist < best_dist) {
+        best = opt;
+        best_dist = dist;
       }
-      count += 1;
-    } else {
-      if (!last_n) {
-        last_n = i;
-      } else {
-        last_n = last_n->_next = i;
+    }
+    return best ? best->lname : NULL;
+  }
+
+  /* names differing in length by N are at least N edits away, so buckets are
+   * visited outward from the length of the name until none can be closer */
+  for (size_t diff = 0; diff < best_dist; ++diff) {
+    size_t const lengths[2] = {len - diff, len + diff};
+    for (size_t k = 0; k < (diff ? 2u : 1u); ++k) {
+      size_t const opt_len = lengths[k];
+      if ((k == 0 && diff > len) || opt_len > OPT_SUGGEST_MAX_LEN)
+        continue;
+      for (size_t j = parser->length_start[opt_len]; j < parser->length_start[opt_len + 1]; ++j) {
+        Option const* opt = parser->order[parser->by_length[j]];
+        STATS_ADD(compares, 1);
+        size_t const dist = edit_distance(opt->lname, opt_len, str, len, best_dist - 1);
+        if (dist < best_dist) {
+          best = opt;
+          best_dist = dist;
+        }
       }
     }
   }
+  return best ? best->lname : NULL;
+}
 
-  if (last_n)
-    last_n->_next = pos->start;
+static size_t edit_distance(char const* a, size_t a_len, char const* b, size_t b_len, size_t bound) {
+  size_t rows[3][OPT_SUGGEST_MAX_LEN + 1];
+  size_t* before = rows[0];
+  size_t* prev = rows[1];
+  size_t* cur = rows[2];
 
-  pos->end->_next = NULL;
-  return count;
-}
+  for (size_t j = 0; j <= b_len; ++j)
+    prev[j] = j;
 
-static Option* find_option_lname(OptionList const* opts, char const* str) {
-  OPTLIST_FOREACH(opts, opt) {
-    if (opt->type == OPTION_POSITIONAL)
-      return NULL;
-    if (!opt->lname)
-      continue;
-    if (strcmp(opt->lname, str) == 0)
-      return opt;
+  for (size_t i = 1; i <= a_len; ++i) {
+    cur[0] = i;
+    size_t row_min = i;
+    for (size_t j = 1; j <= b_len; ++j) {
+      size_t dist = prev[j - 1] + (a[i - 1] != b[j - 1]);
+      if (prev[j] + 1 < dist)
+        dist = prev[j] + 1;
+      if (cur[j - 1] + 1 < dist)
+        dist = cur[j - 1] + 1;
+      if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && before[j - 2] + 1 < dist)
+        dist = before[j - 2] + 1;
+      cur[j] = dist;
+      if (dist < row_min)
+        row_min = dist;
+    }
+    /* the distance never drops below the row minimum */
+    if (row_min > bound)
+      return bound + 1;
+    size_t* swap = before;
+    before = prev;
+    prev = cur;
+    cur = swap;
   }
-  return NULL;
+  return prev[b_len] > bound ? bound + 1 : prev[b_len];
 }
 
-static Option* find_option_sname(OptionList const* opts, char const* str) {
-  OPTLIST_FOREACH(opts, opt) {
-    if (opt->type == OPTION_POSITIONAL)
-      return NULL;
-    if (!opt->sname)
-      continue;
-    if (str[0] == opt->sname)
-      return opt;
+static int snapshot_write(OptParser const* parser, OptParseState const* state, OptBuf* buf) {
+  uint64_t const* activated = state->bits ? state->bits : state->activated;
+  OptSnapshotHeader header = {
+      .spec_hash = spec_hash(parser),
+      .n_options = parser->n_options,
+      .pos_count = state->pos_count,
+      .tail = state->tail,
+  };
+  memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  buf_write(buf, (char const*)&header, sizeof(header));
+  buf_write(buf, (char const*)activated, (parser->n_options + 63) / 64 * sizeof(*activated));
+
+  size_t const n_flags = parser->n_options - parser->n_positionals;
+  for (size_t i = 0; i < n_flags; ++i) {
+    Option const* opt = parser->order[i];
+    if (bitset_test(activated, i) && snapshot_write_option(opt, option_dest(opt, state), buf) == -1)
+      return -1;
   }
-  return NULL;
+  for (size_t i = 0; i < state->pos_count; ++i) {
+    char const* value = *(char const* const*)option_dest(parser->order[n_flags + i], state);
+    uint64_t const len = strlen(value) + 1;
+    buf_write(buf, (char const*)&len, sizeof(len));
+    buf_write(buf, value, len);
+  }
+  return 0;
 }
 
-static int execute_option(Option* opt, int idx, int argc, char** argv, OptParserError* err) {
-  assert(opt->type != OPTION_POSITIONAL);
+static int snapshot_write_option(Option const* opt, void const* dest, OptBuf* buf) {
+  uint64_t len = value_size(opt->type);
   switch (opt->type) {
-  case OPTION_STORE_STR:
-    if (idx + 1 == argc) {
-      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = argv[idx]};
-      return -1;
-    }
-    *(char const**)opt->dest = argv[idx + 1];
+  case OPTION_FLAG:
+  case OPTION_INCREMENT:
+  case OPTION_STORE_INT:
+  case OPTION_STORE_UINT:
+  case OPTION_STORE_SIZE:
+  case OPTION_STORE_DOUBLE:
+    buf_write(buf, (char const*)&len, sizeof(len));
+    buf_write(buf, dest, len);
     break;
-  case OPTION_STORE_INT: {
-    if (idx + 1 == argc) {
-      *err = (OptParserError){OPTERROR_ARGUMENT_REQUIRED, .opt = argv[idx]};
-      return -1;
-    }
-
-    char* end = NULL;
-    long result = strtol(argv[idx + 1], &end, 10);
-    if (*end != '\0') {
-      *err = (OptParserError){OPTERROR_INT_TYPE_ERROR, .opt = argv[idx]};
-      return -1;
-    }
-
-    *(long*)opt->dest = result;
+  case OPTION_STORE_STR:
+  case OPTION_CONFIG:
+  case OPTION_LAZY: {
+    char const* value = opt->type == OPTION_LAZY ? ((OptLazy const*)dest)->raw : *(char const* const*)dest;
+    len = strlen(value) + 1;
+    buf_write(buf, (char const*)&len, sizeof(len));
+    buf_write(buf, value, len);
     break;
   }
-  case OPTION_FLAG:
-    *(bool*)opt->dest = true;
+  case OPTION_APPEND_STR: {
+    OptStrList const* list = dest;
+    uint64_t const count = list->count;
+    len = sizeof(count);
+    for (size_t i = 0; i < list->count; ++i)
+      len += strlen(list->items[i]) + 1;
+    buf_write(buf, (char const*)&len, sizeof(len));
+    buf_write(buf, (char const*)&count, sizeof(count));
+    for (size_t i = 0; i < list->count; ++i)
+      buf_write(buf, list->items[i], strlen(list->items[i]) + 1);
     break;
-  case OPTION_INCREMENT:
-    *(int*)opt->dest += 1;
+  }
+  case OPTION_APPEND_INT:
+  case OPTION_STORE_INT_LIST: {
+    OptIntList const* list = dest;
+    uint64_t const count = list->count;
+    len = sizeof(count) + list->count * sizeof(*list->items);
+    buf_write(buf, (char const*)&len, sizeof(len));
+    buf_write(buf, (char const*)&count, sizeof(count));
+    buf_write(buf, (char const*)list->items, list->count * sizeof(*list->items));
     break;
+  }
+  case OPTION_CALLBACK:
+    return -1;
   case OPTION_POSITIONAL:
     __builtin_unreachable();
   }
-  opt->_activated = true;
   return 0;
 }
 
-static bool opt_has_argument(Option const* opt) {
+static int snapshot_read_option(Option const* opt, OptParseState* state, char const* data, size_t len,
+                                OptParserError* err) {
+  void* const dest = option_dest(opt, state);
+  uint64_t count = 0;
   switch (opt->type) {
-  case OPTION_STORE_STR:
-  case OPTION_STORE_INT:
-    return true;
-  case OPTION_POSITIONAL:
   case OPTION_FLAG:
+    /* any other byte is not a valid bool */
+    if (len != sizeof(bool) || (data[0] != 0 && data[0] != 1))
+      break;
+    *(bool*)dest = data[0];
+    return 0;
   case OPTION_INCREMENT:
-  default:
-    return false;
+  case OPTION_STORE_INT:
+  case OPTION_STORE_UINT:
+  case OPTION_STORE_SIZE:
+  case OPTION_STORE_DOUBLE:
+    if (len != value_size(opt->type))
+      break;
+    memcpy(dest, data, len);
+    return 0;
+  case OPTION_STORE_STR:
+  case OPTION_CONFIG:
+  case OPTION_LAZY:
+    if (len == 0 || data[len - 1] != '\0')
+      break;
+    if (opt->type == OPTION_LAZY)
+      *(OptLazy*)dest = (OptLazy){data, opt, OPTLAZY_PENDING};
+    else
+      *(char const**)dest = data;
+    return 0;
+  case OPTION_APPEND_STR: {
+    if (len < sizeof(count) || data[len - 1] != '\0')
+      break;
+    memcpy(&count, data, sizeof(count));
+    /* every item takes at least its NUL, so a count past the rest of the
+     * record is invalid before anything is reserved for it */
+    if (count > len - sizeof(count))
+      break;
+    OptStrList* list = dest;
+    list->capacity = 0;
+    list->items = arena_reserve(state, NULL, 0, &list->capacity, count, sizeof(*list->items));
+    if (!list->items) {
+      *err = (OptParserError){arena_error(state), .sname = opt->sname, .lname = opt->lname};
+      return -1;
+    }
+    char const* item = data + sizeof(count);
+    for (list->count = 0; list->count < count && item < data + len; ++list->count) {
+      list->items[list->count] = item;
+      item += strlen(item) + 1;
+    }
+    if (list->count != count || item != data + len)
+      break;
+    return 0;
+  }
+  case OPTION_APPEND_INT:
+  case OPTION_STORE_INT_LIST: {
+    if (len < sizeof(count))
+      break;
+    memcpy(&count, data, sizeof(count));
+    OptIntList* list = dest;
+    if (count != (len - sizeof(count)) / sizeof(*list->items) || (len - sizeof(count)) % sizeof(*list->items))
+      break;
+    list->capacity = 0;
+    list->items = arena_reserve(state, NULL, 0, &list->capacity, count, sizeof(*list->items));
+    if (!list->items) {
+      *err = (OptParserError){arena_error(state), .sname = opt->sname, .lname = opt->lname};
+      return -1;
+    }
+    memcpy(list->items, data + sizeof(count), count * sizeof(*list->items));
+    list->count = count;
+    return 0;
+  }
+  case OPTION_CALLBACK:
+    break;
+  case OPTION_POSITIONAL:
+    __builtin_unreachable();
   }
+
+  *err = (OptParserError){OPTERROR_SNAPSHOT, .sname = opt->sname, .lname = opt->lname};
+  return -1;
 }
 
-static int print_option_names(Option const* opt, FILE* fout) {
-  assert(opt->sname || opt->lname);
-  if (!opt->sname)
-    return fprintf(fout, "--%s", opt->lname);
-  else if (!opt->lname)
-    return fprintf(fout, "-%c", opt->sname);
-  else
-    return fprintf(fout, "-%c|--%s", opt->sname, opt->lname);
+static char const* snapshot_record(char const** p, char const* end, size_t* len) {
+  uint64_t record_len;
+  if ((size_t)(end - *p) < sizeof(record_len))
+    return NULL;
+  memcpy(&record_len, *p, sizeof(record_len));
+  *p += sizeof(record_len);
+  if (record_len > (size_t)(end - *p))
+    return NULL;
+  char const* record = *p;
+  *p += record_len;
+  *len = (size_t)record_len;
+  return record;
 }
 
-static int print_option_bare(Option const* opt, FILE* fout) {
-  int total_len = 0;
+static uint64_t spec_hash(OptParser const* parser) {
+  uint64_t hash = hash_bytes(14695981039346656037u, &parser->n_options, sizeof(parser->n_options));
+  for (size_t i = 0; i < parser->n_options; ++i) {
+    Option const* opt = parser->order[i];
+    uint32_t const type = opt->type;
+    hash = hash_bytes(hash, &type, sizeof(type));
+    hash = hash_bytes(hash, &opt->sname, sizeof(opt->sname));
+    hash = hash_bytes(hash, &opt->offset, sizeof(opt->offset));
+    if (opt->lname)
+      hash = hash_bytes(hash, opt->lname, strlen(opt->lname) + 1);
+  }
+  return hash;
+}
 
-  switch (opt->type) {
+static uint64_t hash_bytes(uint64_t hash, void const* data, size_t len) {
+  unsigned char const* bytes = data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
 
+static size_t value_size(OptionType type) {
+  switch (type) {
+  case OPTION_FLAG:
+    return sizeof(bool);
+  case OPTION_INCREMENT:
+    return sizeof(int);
+  case OPTION_STORE_INT:
+    return sizeof(long);
+  case OPTION_STORE_UINT:
+    return sizeof(unsigned long);
+  case OPTION_STORE_SIZE:
+    return sizeof(uint64_t);
+  case OPTION_STORE_DOUBLE:
+    return sizeof(double);
   case OPTION_POSITIONAL:
-    assert(opt->lname || opt->metavar);
-    total_len += fprintf(fout, "%s", opt->metavar ? opt->metavar : opt->lname);
-    break;
+  case OPTION_STORE_STR:
+  case OPTION_APPEND_STR:
+  case OPTION_APPEND_INT:
+  case OPTION_STORE_INT_LIST:
+  case OPTION_CONFIG:
+  case OPTION_CALLBACK:
+  case OPTION_LAZY:
+    return 0;
+  }
+  __builtin_unreachable();
+}
 
-  case OPTION_FLAG:
-    /* fallthrough */
+static void render_help_entry(OptParser const* parser, Option const* opt, OptBuf* buf) {
+  size_t const start = buf->total;
+  buf_puts(buf, "  ");
+  print_option_bare(opt, buf);
+  if (!opt->help)
+    return;
 
-  case OPTION_INCREMENT:
-    total_len += print_option_names(opt, fout);
-    break;
+  OptHelpCache const* cache = parser->help_cache;
+  size_t const opt_column_len = cache && cache->has_widths ? cache->widths[option_position(parser, opt)] : buf->total - start;
+  if (opt_column_len >= OPT_COLUMN_WIDTH) {
+    buf_putc(buf, '\n');
+    buf_pad(buf, OPT_COLUMN_WIDTH);
+  } else {
+    buf_pad(buf, OPT_COLUMN_WIDTH - opt_column_len);
+  }
+  buf_puts(buf, opt->help);
+  buf_putc(buf, '\n');
+}
 
-  case OPTION_STORE_STR:
-    /* fallthrough */
+static void render_help_group(OptParser const* parser, char const* group, OptBuf* buf) {
+  for (size_t i = 0; i < parser->n_options; ++i) {
+    Option const* opt = parser->order[i];
+    if (opt->group == group || (opt->group && group && strcmp(opt->group, group) == 0))
+      render_help_entry(parser, opt, buf);
+  }
+}
 
-  case OPTION_STORE_INT:
-    total_len += print_option_names(opt, fout);
-    if (opt->metavar)
-      total_len += fprintf(fout, " %s", opt->metavar);
-    else if (opt->lname)
-      total_len += fprintf(fout, " %s", opt->lname);
-    else
-      total_len += fprintf(fout, " %c", opt->sname);
-    break;
+static void render_help_prefix(OptParser const* parser, char const* prefix, OptBuf* buf) {
+  size_t const len = strlen(prefix);
+  OptIndex const* index = parser->index;
+  if (index && index->sorted) {
+    for (size_t i = find_option_sorted(index, prefix, len);
+         i < index->n_sorted && strncmp(index->sorted[i]->lname, prefix, len) == 0; ++i)
+      render_help_entry(parser, index->sorted[i], buf);
+    return;
   }
 
-  return total_len;
+  for (size_t i = 0; i < parser->n_options - parser->n_positionals; ++i) {
+    Option const* opt = parser->order[i];
+    if (opt->lname && strncmp(opt->lname, prefix, len) == 0)
+      render_help_entry(parser, opt, buf);
+  }
 }
 
-static int parse_short_opts(OptionList* opts, int idx, int argc, char** argv, int* omit_idx, OptParserError* err) {
-  char const* str = argv[idx];
-  size_t const len = strlen(str);
+static int snapshot_load(OptParser const* parser, OptParseState* state, void const* data, size_t size,
+                         OptParserError* err) {
+  OptSnapshotHeader header;
+  size_t const n_words = (parser->n_options + 63) / 64;
+  if (!state_fits(parser, state)) {
+    *err = (OptParserError){.type = OPTERROR_TOO_MANY_OPTIONS};
+    return -1;
+  }
+  uint64_t* const activated = state_bits(state);
+  if (size < sizeof(header) + n_words * sizeof(uint64_t))
+    goto invalid;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 || header.size != size ||
+      header.spec_hash != spec_hash(parser) || header.n_options != parser->n_options ||
+      header.pos_count > parser->n_positionals || header.tail < 0 || header.tail > INT_MAX)
+    goto invalid;
 
-  for (size_t i = 1; i < len; ++i) {
-    Option* opt = find_option_sname(opts, argv[idx] + i);
-    if (!opt) {
-      *err = (OptParserError){OPTERROR_UNKNOWN, .opt = argv[idx]};
-      return -1;
-    }
-    if (execute_option(opt, idx, argc, argv, err) == -1)
+  clear_state(parser, state);
+  char const* p = (char const*)data + sizeof(header);
+  char const* const end = (char const*)data + size;
+  memcpy(activated, p, n_words * sizeof(uint64_t));
+  p += n_words * sizeof(uint64_t);
+  if (parser->n_options % 64 && activated[n_words - 1] >> parser->n_options % 64)
+    goto invalid;
+
+  size_t const n_flags = parser->n_options - parser->n_positionals;
+  for (size_t i = 0; i < parser->n_options; ++i) {
+    if (!bitset_test(activated, i))
+      continue;
+    size_t len;
+    char const* record = snapshot_record(&p, end, &len);
+    if (i >= n_flags || !record)
+      goto invalid;
+    if (snapshot_read_option(parser->order[i], state, record, len, err) == -1) {
+      memset(activated, 0, n_words * sizeof(*activated));
       return -1;
-    if (opt_has_argument(opt)) {
-      if (*omit_idx != -1) {
-        *err = (OptParserError){OPTERROR_ONE_ARG_OPT_PER_GROUP, .opt = argv[idx], .sname = argv[idx][i]};
-      }
-      *omit_idx = idx + 1;
     }
   }
 
+  for (size_t i = 0; i < header.pos_count; ++i) {
+    size_t len;
+    char const* record = snapshot_record(&p, end, &len);
+    if (!record || len == 0 || record[len - 1] != '\0')
+      goto invalid;
+    *(char const**)option_dest(parser->order[n_flags + i], state) = record;
+  }
+  if (p != end)
+    goto invalid;
+
+  state->pos_count = (size_t)header.pos_count;
+  state->tail = (int)header.tail;
   return 0;
+
+invalid:
+  memset(activated, 0, n_words * sizeof(*activated));
+  *err = (OptParserError){.type = OPTERROR_SNAPSHOT};
+  return -1;
+}
+
+static OptParserErrorType arena_error(OptParseState const* state) {
+  return state->arena ? OPTERROR_ARENA_FULL : OPTERROR_NO_ARENA;
 }
 
-static int print_option(Option const* opt, FILE* fout) {
-  int total_len = 0;
+static void c_numeric_init(void) { c_numeric = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0); }
 
-  if (!opt->required && opt->type != OPTION_POSITIONAL)
-    total_len += fprintf(fout, "[");
-  total_len += print_option_bare(opt, fout);
-  if (!opt->required && opt->type != OPTION_POSITIONAL)
-    total_len += fprintf(fout, "]");
+static ParserLayout parser_layout(size_t n_options) {
+  size_t const n_words = (n_options + 63) / 64;
+  ParserLayout layout;
+  layout.order = 0;
+  layout.required = align8(layout.order + n_options * sizeof(Option const*));
+  layout.envs = layout.required + n_words * sizeof(uint64_t);
+  layout.keys = layout.envs + n_words * sizeof(uint64_t);
+  layout.by_length = layout.keys + n_options * sizeof(OptKey);
+  layout.positions = layout.by_length + n_options * sizeof(uint32_t);
+  /* at most half full, so probes stay short */
+  layout.n_slots = 1;
+  while (layout.n_slots < 2 * n_options)
+    layout.n_slots *= 2;
+  layout.size = layout.positions + layout.n_slots * sizeof(uint32_t);
+  return layout;
+}
+
+static size_t align8(size_t n) { return (n + 7) / 8 * 8; }
+
+static size_t count_options(OptionList const* opts) {
+  size_t count = 0;
+  OPTLIST_FOREACH(opts, opt) { count += 1; }
+  return count;
+}
 
-  total_len += fprintf(fout, " ");
+static void print_list(OptionList* opts, ListOutput output, char const* arg, FILE* fout) {
+  uint64_t data[parser_layout(count_options(opts)).size / sizeof(uint64_t) + 1];
+  OptParser parser;
+  if (optparser_compile(&parser, opts, data, sizeof(data)) != 0)
+    return;
+
+  switch (output) {
+  case LIST_USAGE:
+    optparser_print_usage(&parser, fout, arg);
+    break;
+  case LIST_HELP:
+    optparser_print_help(&parser, fout);
+    break;
+  case LIST_HELP_GROUP:
+    optparser_print_help_group(&parser, arg, fout);
+    break;
+  case LIST_HELP_PREFIX:
+    optparser_print_help_prefix(&parser, arg, fout);
+    break;
+  }
+}
+
+static size_t option_position(OptParser const* parser, Option const* opt) {
+  if (parser->table)
+    return (size_t)(opt - parser->table);
+  for (size_t slot = position_slot(opt, parser->positions_mask);; slot = (slot + 1) & parser->positions_mask) {
+    uint32_t const position = parser->positions[slot];
+    assert(position != 0);
+    if (parser->order[position - 1] == opt)
+      return position - 1;
+  }
+}
+
+static size_t position_slot(Option const* opt, size_t mask) {
+  return (size_t)(((uint64_t)(uintptr_t)opt * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask;
+}
+
+static void build_positions(OptParser* parser, uint32_t* positions, size_t n_slots) {
+  bool contiguous = true;
+  for (size_t i = 1; i < parser->n_options && contiguous; ++i)
+    contiguous = (uintptr_t)parser->order[i] == (uintptr_t)parser->order[0] + i * sizeof(Option);
+  parser->table = contiguous && parser->n_options ? parser->order[0] : NULL;
+  parser->positions = NULL;
+  parser->positions_mask = 0;
+  if (parser->table)
+    return;
+
+  memset(positions, 0, n_slots * sizeof(*positions));
+  size_t const mask = n_slots - 1;
+  for (size_t i = 0; i < parser->n_options; ++i) {
+    size_t slot = position_slot(parser->order[i], mask);
+    while (positions[slot])
+      slot = (slot + 1) & mask;
+    positions[slot] = (uint32_t)(i + 1);
+  }
+  parser->positions = positions;
+  parser->positions_mask = mask;
+}
 
-  return total_len;
+static int iter_source_error(OptIter* iter, OptParserError* err) {
+  iter->group = NULL;
+  iter->done = true;
+  *err = (OptParserError){.type = OPTERROR_TOKEN_SOURCE};
+  return -1;
 }
@@ -2,16 +2,45 @@
 #define OPTPARSE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #if !defined(OPT_COLUMN_WIDTH)
 #define OPT_COLUMN_WIDTH 30
 #endif
 
+#if !defined(OPT_HELP_BUFFER_SIZE)
+#define OPT_HELP_BUFFER_SIZE 4096
+#endif
+
+#if !defined(OPT_MAX_ENV_OPTIONS)
+#define OPT_MAX_ENV_OPTIONS 64
+#endif
+
+#if !defined(OPT_SUGGEST_DISTANCE)
+#define OPT_SUGGEST_DISTANCE 2
+#endif
+
+/* The following limits size the public structs, so they are fixed by the
+ * library and cannot be overridden */
+
+/** Options tracked by a parse state without `optparse_state_bits` */
+#define OPT_MAX_OPTIONS 1024
+
+/** Files mapped by a parse */
+#define OPT_MAX_RESPONSE_FILES 16
+
+/** Longest long name suggested for an unknown option */
+#define OPT_SUGGEST_MAX_LEN 32
+
+#define OPT_BITSET_WORDS ((OPT_MAX_OPTIONS + 63) / 64)
+
 #define OPTLIST_INIT(LL, OPT)                                                                                          \
   do {                                                                                                                 \
     LL.start = &(OPT);                                                                                                 \
     LL.end = &(OPT);                                                                                                   \
+    LL.index = NULL;                                                                                                   \
   } while (0)
 
 #define OPTLIST_ADD(LL, OPT)                                                                                           \
@@ -28,8 +57,67 @@ typedef enum {
   OPTION_STORE_STR,
   OPTION_STORE_INT,
   OPTION_INCREMENT,
+  OPTION_STORE_UINT,
+  OPTION_STORE_SIZE,
+  OPTION_STORE_DOUBLE,
+  OPTION_APPEND_STR,
+  OPTION_APPEND_INT,
+  OPTION_STORE_INT_LIST,
+  OPTION_CONFIG,
+  OPTION_CALLBACK,
+  OPTION_LAZY,
 } OptionType;
 
+struct Option;
+
+/** Option argument converter
+ *
+ * Converts `value`, the argument of `opt`, into `dest`.
+ *
+ * @return 0 on success, -1 if the argument is invalid
+ */
+typedef int (*OptConverter)(struct Option const* opt, char const* value, void* dest);
+
+/** Command line option
+ *
+ * Destination types by option type:
+ *
+ * - OPTION_POSITIONAL, OPTION_STORE_STR, OPTION_CONFIG: `char const*`
+ * - OPTION_FLAG: `bool`
+ * - OPTION_INCREMENT: `int`
+ * - OPTION_STORE_INT: `long`
+ * - OPTION_STORE_UINT: `unsigned long`
+ * - OPTION_STORE_SIZE: `uint64_t`
+ * - OPTION_STORE_DOUBLE: `double`
+ * - OPTION_APPEND_STR: `OptStrList`
+ * - OPTION_APPEND_INT, OPTION_STORE_INT_LIST: `OptIntList`
+ * - OPTION_CALLBACK: any type, written by `convert`
+ * - OPTION_LAZY: `OptLazy`, or a struct starting with it
+ *
+ * Integer arguments are decimal, or hexadecimal with a `0x` prefix. Sizes may
+ * have a K, M, G or T suffix, in any case, multiplying them by a power of 1024.
+ * Int lists are comma-separated decimals, every occurrence of the option
+ * appends its items to the list. Doubles have the syntax of `strtod` in the
+ * "C" locale, so the decimal point is '.' whatever LC_NUMERIC is.
+ *
+ * A non-positional option with an `env` name takes its value from that
+ * environment variable when it is not given in the arguments. An option
+ * without an argument is activated by a variable or config value other than
+ * empty, "0", "false", "no" and "off".
+ *
+ * An OPTION_CONFIG option names a config file, see `optparser_parse`. Its
+ * destination may be set to a default path before parsing.
+ *
+ * An OPTION_CALLBACK option converts its argument by calling `convert` with the
+ * destination during the parse. An OPTION_LAZY option only stores its argument
+ * during the parse, `convert` is called with the `OptLazy` destination when the
+ * value is first needed, see `optlazy_convert`. A failed conversion is an
+ * OPTERROR_INVALID_ARGUMENT error. Both require `convert`, which
+ * `optparser_compile` checks; options of an `optspec.h` parser are not checked.
+ *
+ * `group` names the help section of the option, see
+ * `optparser_print_help_group`.
+ */
 typedef struct Option {
   char const* lname;
   char sname;
@@ -39,12 +127,81 @@ typedef struct Option {
   bool required;
   void* dest;
   struct Option* _next;
-  bool _activated;
+  size_t offset;
+  char const* env;
+  OptConverter convert;
+  char const* group;
 } Option;
 
+/** State of an OPTION_LAZY option
+ *
+ * The parse stores the argument in `raw` and sets `status` to
+ * OPTLAZY_PENDING, the conversion sets it to OPTLAZY_DONE or OPTLAZY_FAILED.
+ * The converter of the option receives the `OptLazy` itself, so the
+ * converted value is usually stored in a struct starting with it. The
+ * argument points into the arguments, the environment or a mapped file, and
+ * stays valid as long as the parse state is not released.
+ */
+typedef struct {
+  char const* raw;
+  struct Option const* opt;
+  int status;
+} OptLazy;
+
+enum {
+  OPTLAZY_UNSET = 0,
+  OPTLAZY_PENDING,
+  OPTLAZY_DONE,
+  OPTLAZY_FAILED,
+};
+
+/** Values of an OPTION_APPEND_STR option
+ *
+ * Every occurrence of the option appends its argument to `items`, which is
+ * allocated from the arena of the parse state and valid until the state is
+ * parsed with again. The list is reset by the first occurrence in a parse, so
+ * it needs no initialization, but it is only meaningful if the option is
+ * activated.
+ */
+typedef struct {
+  char const** items;
+  size_t count;
+  size_t capacity;
+} OptStrList;
+
+/** Values of an OPTION_APPEND_INT or OPTION_STORE_INT_LIST option, same as
+ * `OptStrList` */
+typedef struct {
+  long* items;
+  size_t count;
+  size_t capacity;
+} OptIntList;
+
+/** Long option lookup index slot */
+typedef struct {
+  Option const* opt;
+  uint32_t hash;
+  uint32_t len;
+} OptIndexSlot;
+
+/** Long option lookup index
+ *
+ * Open addressing hash table over long names of non-positional options,
+ * and an array of the same options sorted by long name, used to match
+ * abbreviations. Either part is optional; storage of both is owned by the
+ * caller. An index must be zero-initialized before building.
+ */
+typedef struct {
+  OptIndexSlot* slots;
+  size_t mask;
+  Option const** sorted;
+  size_t n_sorted;
+} OptIndex;
+
 typedef struct {
   Option* start;
   Option* end;
+  OptIndex const* index;
 } OptionList;
 
 typedef enum {
@@ -54,18 +211,666 @@ typedef enum {
   OPTERROR_EXPECTED_POSITIONAL,
   OPTERROR_ARGUMENT_REQUIRED,
   OPTERROR_REQUIRED_OPTION,
+  /** Deprecated, no longer produced: several options of a short group may
+   * take an argument, see `optparser_parse` */
   OPTERROR_ONE_ARG_OPT_PER_GROUP,
   OPTERROR_INT_TYPE_ERROR,
+  OPTERROR_TOO_MANY_OPTIONS,
+  OPTERROR_RESPONSE_FILE,
+  OPTERROR_UINT_TYPE_ERROR,
+  OPTERROR_SIZE_TYPE_ERROR,
+  OPTERROR_DOUBLE_TYPE_ERROR,
+  OPTERROR_OUT_OF_RANGE,
+  OPTERROR_ARENA_FULL,
+  OPTERROR_INT_LIST_TYPE_ERROR,
+  OPTERROR_AMBIGUOUS,
+  OPTERROR_EXPECTED_COMMAND,
+  OPTERROR_UNKNOWN_COMMAND,
+  OPTERROR_UNEXPECTED_ARGUMENT,
+  OPTERROR_CONFIG_FILE,
+  OPTERROR_CONFIG_SYNTAX,
+  OPTERROR_INVALID_ARGUMENT,
+  OPTERROR_SNAPSHOT,
+  OPTERROR_NO_ARENA,
+  OPTERROR_NO_CONVERTER,
+  OPTERROR_TOKEN_SOURCE,
 } OptParserErrorType;
 
+/** Parser error
+ *
+ * `column` is the 1-based position of the error in an int list argument, 0
+ * for other errors. `line` is the 1-based line of an error in a config file,
+ * 0 for other errors. `index` is the argv index of the argument with the
+ * error, or of the response file the argument is in, 0 for errors not tied
+ * to an argument. `suggestion` is the long name closest to an unknown long
+ * option or config key, NULL if no name is within OPT_SUGGEST_DISTANCE edits.
+ */
 typedef struct {
   OptParserErrorType type;
   char const* lname;
   char sname;
   char const* opt;
+  size_t column;
+  size_t line;
+  int index;
+  char const* suggestion;
 } OptParserError;
 
+/** Parser flags */
+enum {
+  /** Expand `@path` arguments with the contents of the file */
+  OPTPARSER_RESPONSE_FILES = 1 << 0,
+  /** Accept unique prefixes of long option names */
+  OPTPARSER_ABBREVIATIONS = 1 << 1,
+  /** Stop the parse at `--`, leaving the arguments after it unparsed */
+  OPTPARSER_STOP_AT_TERMINATOR = 1 << 2,
+  /** Stop the parse at the first positional argument past the declared
+   * positionals, leaving it and the arguments after it unparsed */
+  OPTPARSER_STOP_AT_POSITIONAL = 1 << 3,
+  /** Give options taking an argument in a short option group the following
+   * arguments in order, `-ab A B`, instead of the rest of the group, `-aA` */
+  OPTPARSER_GROUP_ARGUMENTS = 1 << 4,
+};
+
+/** Usage and help text rendered by `opthelp_build`
+ *
+ * `text` holds the usage line without the program name, `usage_len` bytes,
+ * followed by `help_len` bytes of help. It is not NUL-terminated.
+ *
+ * `widths` is caller-provided storage with room for every option of the
+ * parser, or NULL. If `has_widths` is set, it holds the width of the name
+ * column of the help entry of every option, indexed by the option position in
+ * the parser order, so the entries printed by `optparser_print_help_group`
+ * and `optparser_print_help_prefix` are aligned without measuring them.
+ */
+typedef struct {
+  char const* text;
+  size_t usage_len;
+  size_t help_len;
+  uint16_t* widths;
+  bool has_widths;
+} OptHelpCache;
+
+/** Long name key of a compiled parser
+ *
+ * `key` has the length of the long name in the upper and its hash in the
+ * lower half, `position` is the position of the option in the parser order.
+ */
+typedef struct {
+  uint64_t key;
+  uint32_t position;
+} OptKey;
+
+/** Compiled option list
+ *
+ * Produced once from an option list by `optparser_compile`, or generated at
+ * compile time by `optspec.h`, and not modified by parsing, so a single parser
+ * can be used for any number of `optparser_parse` calls. The arrays of the
+ * parser are sized by its options and point into the storage given to
+ * `optparser_compile`, or into static data of `optspec.h`.
+ *
+ * `order` holds non-positional options followed by positionals. The position of
+ * an option in the order numbers its bits in the masks and the parse state:
+ * if `table` is set, the order is that array and the position is the offset
+ * in it, otherwise `positions` is an open addressing table of
+ * `positions_mask + 1` slots, hashed by the option address, holding the
+ * position plus one. The options themselves are not written, so lists and
+ * parsers can be shared between threads. The long option index is used if it
+ * is set and built, and so is the help cache. `config` is the
+ * OPTION_CONFIG option, if any. `flags` is a combination of OPTPARSER_* flags.
+ *
+ * If `required` is set, it has the bits of required options set, so missing
+ * options are found by a few word-wide operations after a parse. Likewise, if
+ * `envs` is set, it has the bits of options with an environment variable set.
+ * Both are set by `optparser_compile` and `optspec.h`.
+ *
+ * If `keys` is set, it holds `n_keys` keys of the non-positional options with
+ * a long name sorted by their `key`, so long options without the index are
+ * found by a binary search and only the options with a matching key are
+ * compared. If `by_length` is set, it holds the order positions of options
+ * with a long name of up to OPT_SUGGEST_MAX_LEN bytes sorted by the name
+ * length, and the options with length N are at `by_length[length_start[N]]`
+ * up to `length_start[N + 1]`, so suggestions for an unknown name only look
+ * at names of a similar length. Parsers generated by `optspec.h` have neither,
+ * so their options are scanned instead, unless their index is built.
+ */
+typedef struct {
+  Option const* const* order;
+  size_t n_options;
+  size_t n_positionals;
+  Option const* table;
+  uint32_t const* positions;
+  size_t positions_mask;
+  OptIndex const* index;
+  OptHelpCache const* help_cache;
+  Option const* config;
+  Option const* shorts[256];
+  unsigned flags;
+  uint64_t const* required;
+  uint64_t const* envs;
+  OptKey const* keys;
+  size_t n_keys;
+  uint32_t const* by_length;
+  uint32_t length_start[OPT_SUGGEST_MAX_LEN + 2];
+} OptParser;
+
+typedef struct {
+  void* addr;
+  size_t len;
+} OptMapping;
+
+#if defined(OPT_STATS)
+/** Counters and phase times of a parse
+ *
+ * Collected only if the library is built with OPT_STATS defined. `lookups`
+ * counts long and short option lookups, `compares` the name comparisons made by
+ * them, `conversions` the numbers converted from option arguments. Times are
+ * wall-clock nanoseconds; `compile_ns` is only set by `parse_opts`, which
+ * compiles the option list for every parse, `parse_ns` covers the arguments,
+ * response files and environment fallbacks, `check_ns` the check of positionals
+ * and required options.
+ */
+typedef struct {
+  size_t tokens;
+  size_t lookups;
+  size_t compares;
+  size_t conversions;
+  uint64_t compile_ns;
+  uint64_t parse_ns;
+  uint64_t check_ns;
+} OptStats;
+
+/** Callback receiving the stats of every finished parse */
+typedef void (*OptStatsHook)(OptStats const* stats, void* ctx);
+
+/** Set the stats callback of all parses, NULL to remove it
+ *
+ * The callback is process-wide, it must be set while no parse is running.
+ * It is the only way to get the stats of `parse_opts`, which uses an internal
+ * state. An iteration reports its stats when `opt_next` returns 0 or -1.
+ * Batch parsing calls the callback from its worker threads.
+ */
+void optparse_stats_hook(OptStatsHook hook, void* ctx);
+#endif
+
+/** Per-parse state
+ *
+ * Holds everything a parse modifies apart from the option destinations, so
+ * any number of threads can parse with the same `OptParser`, each one with its
+ * own state.
+ *
+ * `activated` has a bit for every option given by the last parse, indexed by
+ * the option position in the parser order. It is large enough for parsers of
+ * up to OPT_MAX_OPTIONS options; larger parsers need storage for the bits set
+ * by `optparse_state_bits`, which then holds them instead, as `bits`.
+ *
+ * If `base` is not NULL, option values are stored at `base + Option.offset`
+ * instead of `Option.dest`. This allows giving every parse its own instance of
+ * an arguments struct, with offsets taken by `offsetof`.
+ *
+ * Response and config files read by a parse stay mapped in `maps`, since
+ * string values point into them, until the next parse with the state or
+ * `optparse_state_release`.
+ *
+ * Values of append options are stored in the arena, a caller-provided buffer
+ * set by `optparse_state_arena`, which is reused by every parse.
+ *
+ * `tail` is the index of the first argument a parse left unparsed, or
+ * `argc` if it parsed all of them, see OPTPARSER_STOP_AT_TERMINATOR and
+ * OPTPARSER_STOP_AT_POSITIONAL. `stop_at_positional` has the same effect as
+ * the parser flag and is set internally by `optparser_parse_command`.
+ *
+ * `errors` is the error array of the collect mode, see
+ * `optparse_state_errors`.
+ *
+ * With OPT_STATS defined, `stats` holds the stats of the last parse.
+ */
+typedef struct {
+  uint64_t activated[OPT_BITSET_WORDS];
+  uint64_t* bits;
+  size_t bits_words;
+  size_t pos_count;
+  void* base;
+  OptMapping maps[OPT_MAX_RESPONSE_FILES];
+  size_t n_maps;
+  char* arena;
+  size_t arena_size;
+  size_t arena_used;
+  bool stop_at_positional;
+  int tail;
+  OptParserError* errors;
+  size_t errors_capacity;
+  size_t n_errors;
+#if defined(OPT_STATS)
+  OptStats stats;
+#endif
+} OptParseState;
+
+/** Get the storage size required by `optparser_compile` */
+size_t optparser_size(OptionList const* opts);
+
+/** Compile an option list into a parser
+ *
+ * Orders positionals after the other options, numbers the options and builds
+ * the short option table, the sorted long name keys and the option masks. The
+ * long option index is taken from `opts->index` if it is set, the help cache
+ * and flags are cleared. If several options have the same short name, the first
+ * one gets it. The options must not be modified while the parser is in use.
+ *
+ * The arrays of the parser are stored into `data`, a caller-provided buffer of
+ * `size` bytes, which need not be aligned and must stay valid as long as the
+ * parser is used.
+ *
+ * @return 0 on success, -1 if `size` is less than `optparser_size`, -2 if an
+ * OPTION_CALLBACK or OPTION_LAZY option has no `convert`
+ */
+int optparser_compile(OptParser* parser, OptionList* opts, void* data, size_t size);
+
+/** Initialize a parse state
+ *
+ * @see OptParseState for the meaning of `base`
+ */
+void optparse_state_init(OptParseState* state, void* base);
+
+/** Set the storage of the activated bits of parses with the state
+ *
+ * Needed for parsers of more than OPT_MAX_OPTIONS options, which otherwise
+ * fail to parse with OPTERROR_TOO_MANY_OPTIONS. `bits` must have `n_words`
+ * words, 64 options each; NULL `bits` returns to the own bits of the state.
+ */
+void optparse_state_bits(OptParseState* state, uint64_t* bits, size_t n_words);
+
+/** Set the arena for values of append options
+ *
+ * Without an arena, which is the case for `parse_opts`, any append option fails
+ * with OPTERROR_NO_ARENA; a full arena is OPTERROR_ARENA_FULL. The arena need
+ * not be aligned, list arrays are aligned inside it. They grow geometrically,
+ * so an arena of about three times the size of all appended values is enough
+ * even when occurrences of different options are interleaved.
+ */
+void optparse_state_arena(OptParseState* state, void* data, size_t size);
+
+/** Collect the errors of parses with the state into an array
+ *
+ * In collect mode a parse goes on after the errors it can recover from:
+ * unknown or ambiguous options, unexpected arguments and positionals,
+ * missing or invalid option arguments, and missing positionals and required
+ * options are all reported, as are invalid environment and config values and
+ * unknown config keys. Every error of a parse is stored into `errors`, up to
+ * `capacity` errors, and `n_errors` counts all of them. An error the parse
+ * cannot go on after is the last one. A parse with errors still fails, with
+ * the first one in its `err` output variable. The iterator API stops at the
+ * first error of a token either way, only the final check is collected. NULL
+ * `errors` ends the collect mode.
+ */
+void optparse_state_errors(OptParseState* state, OptParserError* errors, size_t capacity);
+
+/** Release the files mapped by the last parse with the state
+ *
+ * A parse releases the files of the previous one itself, so this is needed
+ * before a state is discarded. String values from the files are invalid after
+ * it.
+ */
+void optparse_state_release(OptParseState* state);
+
+/** Parse command line options with a compiled parser
+ *
+ * If the parser has the OPTPARSER_RESPONSE_FILES flag, an argument `@path` is
+ * replaced by the whitespace-separated arguments of the file, which may be
+ * quoted and may include other response files, up to OPT_MAX_RESPONSE_FILES
+ * files per parse, including the config file. String values from the files
+ * point into the mapped file.
+ *
+ * An argument `--` ends options: the arguments after it are positionals, or,
+ * if the parser has the OPTPARSER_STOP_AT_TERMINATOR flag, they are left
+ * unparsed. With OPTPARSER_STOP_AT_POSITIONAL, the parse stops at the first
+ * positional argument for which there is no declared positional. In both
+ * cases the arguments are not looked at past `state->tail`, the index of the
+ * first unparsed argument, so `argv + state->tail` can be passed to e.g.
+ * `execv` as is. Response files never stop a parse.
+ *
+ * If the parser has the OPTPARSER_ABBREVIATIONS flag, a long option that does
+ * not match exactly matches the only option whose long name starts with it,
+ * and is an OPTERROR_AMBIGUOUS error if there are several. Prefixes are
+ * looked up by binary search if the parser index has a sorted array, with a
+ * linear scan otherwise.
+ *
+ * An option argument is given as `--name=value` or `--name value` for a long
+ * option, and as `-ovalue` or `-o value` for a short one, so in a short option
+ * group the rest of the group is the argument of the first option taking one,
+ * even if it names other options: `-sf X` gives `-s` the argument "f" and X
+ * is a positional. With OPTPARSER_GROUP_ARGUMENTS every option of a group
+ * taking an argument takes the next argument instead, `-ab A B`, which keeps
+ * the meaning `-sf X` had before inline values. `--name=value` is an
+ * OPTERROR_UNEXPECTED_ARGUMENT error for an option without an argument.
+ *
+ * After the arguments, options with an `env` name that were not given in them
+ * take their values from the environment. The variables are matched in a
+ * single pass over `environ` through a hash table of the names, built on the
+ * stack for up to OPT_MAX_ENV_OPTIONS options, which must be a power of two;
+ * the names of further options are looked up with `getenv`. A conversion
+ * error of a variable value has the variable name in `err->opt`.
+ *
+ * Then, if the parser has a config option with a path, options still not
+ * given take their values from the config file. The file has `key = value`
+ * lines, where a key is a long option name, blank lines and `#` comments.
+ * Spaces around keys and values are ignored, a value may be quoted with
+ * single or double quotes. Repeated keys are handled like repeated options.
+ * The file is mapped like a response file and string values point into it
+ * as well. A missing file is skipped unless the path was given on the
+ * command line or in the environment. Errors in the file have its line in
+ * `err->line`, unknown keys and conversion errors have the key in `err->opt`.
+ *
+ * The state is reset at the start of the parse, unmapping the files of the
+ * previous one, so it can be reused. After a successful parse
+ * `state->activated` has a bit set for every option given on the command line
+ * or in the environment, indexed by the option position in the compiled list.
+ *
+ * Sets an `err` output variable on error.
+ *
+ * @return 0 on success, -1 on error
+ */
+int optparser_parse(OptParser const* parser, OptParseState* state, int argc, char** argv, OptParserError* err);
+
+/** Convert the value of an OPTION_LAZY option if it is pending
+ *
+ * Only the first call converts, the later ones return its result. Does
+ * nothing for an option that was not given. Must not be called for the same
+ * value from several threads at once.
+ *
+ * Sets an `err` output variable on error.
+ *
+ * @return 0 on success or if the option was not given, -1 on error
+ */
+int optlazy_convert(OptLazy* lazy, OptParserError* err);
+
+/** Convert the values of all OPTION_LAZY options given in the last parse
+ *
+ * A validation pass, which can run e.g. on a separate thread while the
+ * program starts, as long as the values are not accessed meanwhile. Stops at
+ * the first failed conversion.
+ *
+ * Sets an `err` output variable on error.
+ *
+ * @return 0 on success, -1 on error
+ */
+int optparser_convert(OptParser const* parser, OptParseState* state, OptParserError* err);
+
+/** Get the buffer size required by `optsnapshot_save` */
+size_t optsnapshot_size(OptParser const* parser, OptParseState const* state);
+
+/** Save the outcome of the last parse with the state into a buffer
+ *
+ * The snapshot holds the activated bits, the values of the activated options,
+ * the positional arguments and `state->tail`, with strings copied into it and
+ * no pointers, so it can be written to a file and loaded by another process
+ * running the same program. It starts with a hash of the option spec: the
+ * names, types and offsets of the options in their compiled order.
+ *
+ * @return 0 on success, -1 if the buffer is smaller than `optsnapshot_size`
+ * or an OPTION_CALLBACK option was given, whose value cannot be saved
+ */
+int optsnapshot_save(OptParser const* parser, OptParseState const* state, void* data, size_t size);
+
+/** Restore the outcome of a parse from a snapshot
+ *
+ * Resets the state, unmapping the files of the previous parse, and stores the
+ * values into the option destinations the way the parse did, without
+ * converting anything; OPTION_LAZY values are pending again. String values
+ * point into the snapshot, which must stay valid as long as they are used,
+ * and lists are allocated from the arena.
+ * Missing positionals and required options are not checked again.
+ *
+ * Sets an `err` output variable on error: OPTERROR_SNAPSHOT if the snapshot
+ * is malformed or was saved with a different option spec.
+ *
+ * @return 0 on success, -1 on error
+ */
+int optsnapshot_load(OptParser const* parser, OptParseState* state, void const* data, size_t size,
+                     OptParserError* err);
+
+/** Restore the outcome of a parse from a snapshot file
+ *
+ * Same as `optsnapshot_load`, with the file mapped like a response file, so
+ * it stays mapped until the next parse with the state or
+ * `optparse_state_release`. An error opening or mapping the file is
+ * OPTERROR_SNAPSHOT with the path in `err->opt`.
+ *
+ * @return 0 on success, -1 on error
+ */
+int optsnapshot_load_file(OptParser const* parser, OptParseState* state, char const* path, OptParserError* err);
+
+/** Subcommand
+ *
+ * `setup` is called only when the subcommand is selected; it returns the
+ * parser of the subcommand, or NULL if it cannot be used, and may prepare the
+ * state the subcommand is parsed with, e.g. by `optparse_state_init` with the
+ * arguments struct of the subcommand. So the option specs of subcommands that
+ * are not selected are never materialized. `ctx` is passed to `setup` through
+ * the command.
+ */
+typedef struct OptCommand {
+  char const* name;
+  char const* help;
+  OptParser const* (*setup)(struct OptCommand const* command, OptParseState* state);
+  void* ctx;
+} OptCommand;
+
+/** Parse a command line with subcommands
+ *
+ * Parses global options with `parser` up to the first positional argument
+ * past its declared positionals, which names the subcommand; positionals
+ * inside response files cannot name it. The arguments from the subcommand
+ * name on are parsed with the subcommand parser and `command_state`, the same
+ * way `optparser_parse` does with the name as `argv[0]`.
+ *
+ * `command_state` is initialized by `optparse_state_init` before `setup` is
+ * called, so it needs no initialization; files mapped by a previous parse with
+ * it must be released with `optparse_state_release` first.
+ *
+ * Sets `command` to the selected subcommand, or NULL if there is none. Sets
+ * an `err` output variable on error.
+ *
+ * @return 0 on success, -1 on error
+ */
+int optparser_parse_command(OptParser const* parser, OptParseState* state, OptCommand const* commands,
+                            size_t n_commands, OptParseState* command_state, int argc, char** argv,
+                            OptCommand const** command, OptParserError* err);
+
+/** Print the names and help strings of subcommands */
+void optcommand_print_help(OptCommand const* commands, size_t n_commands, FILE* fout);
+
+/** Argument selecting the completion mode of `optparser_complete` */
+#define OPT_COMPLETE_ARG "--__complete"
+
+/** Answer a shell completion request
+ *
+ * A completion request is `prog --__complete INDEX WORDS...`, where WORDS is
+ * the command line being completed, starting with the program name, and INDEX
+ * is the position of the word under the cursor, as COMP_CWORD of bash. The
+ * candidates for the word are printed one per line:
+ *
+ * - for a word starting with `--`, the long options starting with it, found
+ *   by binary search if the parser index has a sorted array;
+ * - for `-`, the short options and all long options;
+ * - for other words, the subcommands starting with it, unless a subcommand is
+ *   already given, in which case the rest of the words are completed with the
+ *   subcommand parser.
+ *
+ * If the word is an option argument, the only line is `:` followed by the
+ * metavar of the option, so the shell can complete it e.g. as a path.
+ *
+ * The words before the cursor are only scanned for option arguments, `--`
+ * and the subcommand, without parsing or validating them, so this should be
+ * called first in `main`, before any other initialization.
+ *
+ * @return 1 if the arguments are a completion request, which is answered, 0
+ * otherwise
+ */
+int optparser_complete(OptParser const* parser, OptCommand const* commands, size_t n_commands, int argc, char** argv,
+                       FILE* fout);
+
+/** Print a bash completion script
+ *
+ * The options and subcommand names of the parser are written into the script,
+ * so completing them does not run the program. Options of a subcommand are
+ * completed by running the program in completion mode, see
+ * `optparser_complete`. Arguments of options are completed as paths.
+ */
+void optparser_print_completion(OptParser const* parser, OptCommand const* commands, size_t n_commands,
+                                char const* progname, FILE* fout);
+
+/** Token source of the iterator API
+ *
+ * Returns the next token, NULL when there are no more tokens, or
+ * `opt_source_error` if the next token cannot be read. A token must stay valid
+ * as long as values stored from it are used.
+ */
+typedef char* (*OptTokenSource)(void* ctx);
+
+/** Token returned by a token source that failed to read a token */
+extern char opt_source_error[1];
+
+/** Cursor over tokens pulled one at a time from a token source */
+typedef struct {
+  OptParser const* parser;
+  OptParseState* state;
+  OptTokenSource source;
+  void* ctx;
+  char* group;
+  size_t group_pos;
+  bool options_done;
+  bool done;
+} OptIter;
+
+/** Option or positional matched by `opt_next`
+ *
+ * `opt` is NULL for positional arguments past the declared positionals.
+ * `value` is the option argument or the positional argument.
+ */
+typedef struct {
+  Option const* opt;
+  char* value;
+} OptMatch;
+
+/** Start parsing tokens from a token source
+ *
+ * Resets the state like `optparser_parse`. Response files are not expanded.
+ * Tokens after `--` are positionals; with OPTPARSER_STOP_AT_TERMINATOR the
+ * iteration ends at `--` and the rest of the tokens are left in the source.
+ */
+void optiter_init(OptIter* iter, OptParser const* parser, OptParseState* state, OptTokenSource source, void* ctx);
+
+/** Parse the next option or positional
+ *
+ * The value is stored as `optparser_parse` would store it, and the match is
+ * returned in `match`. Every option of a short option group is returned by a
+ * separate call. Option arguments are taken as `optparser_parse` takes them:
+ * from `--name=value`, from the rest of a short option group or from the next
+ * token. When the source is exhausted, missing positionals and
+ * required options are checked, and every later call returns 0.
+ *
+ * Sets an `err` output variable on error, OPTERROR_TOKEN_SOURCE if the source
+ * returned `opt_source_error`, which also ends the iteration. A state with no
+ * room for the options of the parser is an OPTERROR_TOO_MANY_OPTIONS error.
+ *
+ * @return 1 on a match, 0 at the end of tokens, -1 on error
+ */
+int opt_next(OptIter* iter, OptMatch* match, OptParserError* err);
+
+/** Argument array token source, starting at `idx` */
+typedef struct {
+  int argc;
+  char** argv;
+  int idx;
+} OptArgvSource;
+
+/** Token source over an `OptArgvSource` */
+char* opt_argv_source(void* ctx);
+
+/** NUL-delimited stream token source, as produced by e.g. `find -print0`
+ *
+ * Every token is read into `buf` of `size` bytes, so it is only valid until
+ * the next token is read. A token that does not fit, with its NUL, is skipped
+ * and returned as `opt_source_error`, and sets `overflow`.
+ */
+typedef struct {
+  FILE* fin;
+  char* buf;
+  size_t size;
+  bool overflow;
+} OptNulStream;
+
+/** Token source over an `OptNulStream` */
+char* opt_nul_stream_source(void* ctx);
+
+/** Print program usage of a compiled parser
+ *
+ * Writes the cached usage if the parser has a built help cache, otherwise
+ * renders it through an OPT_HELP_BUFFER_SIZE stack buffer.
+ */
+void optparser_print_usage(OptParser const* parser, FILE* fout, char const* progname);
+
+/** Print help strings of a compiled parser
+ *
+ * Writes the cached help with a single `fwrite` if the parser has a built help
+ * cache, otherwise renders it through an OPT_HELP_BUFFER_SIZE stack buffer.
+ */
+void optparser_print_help(OptParser const* parser, FILE* fout);
+
+/** Print help strings of the options of a group
+ *
+ * Same as `optparser_print_help` for the options whose `group` is `group`, or
+ * for the options without a group if it is NULL. Only the matching entries
+ * are rendered, only the widths of the help cache are used.
+ */
+void optparser_print_help_group(OptParser const* parser, char const* group, FILE* fout);
+
+/** Print help strings of the long options starting with a prefix
+ *
+ * Same as `optparser_print_help_group`. The options are found by binary search
+ * and printed in name order if the parser index has a sorted array, otherwise
+ * they are scanned for and printed in the parser order.
+ */
+void optparser_print_help_prefix(OptParser const* parser, char const* prefix, FILE* fout);
+
+/** Get the buffer size required by `opthelp_build` */
+size_t opthelp_size(OptParser const* parser);
+
+/** Render usage and help of a parser once into a caller-provided buffer
+ *
+ * Once built, the cache is used by the print functions of the parser if it is
+ * assigned to `parser->help_cache`; parsers generated by `optspec.h` already
+ * point to their own cache. The buffer is referenced by the cache. The help
+ * entry widths are measured as well, see `opthelp_measure`.
+ *
+ * @return 0 on success, -1 if the buffer is smaller than `opthelp_size`
+ */
+int opthelp_build(OptHelpCache* cache, OptParser const* parser, char* data, size_t size);
+
+/** Measure the help entry widths of a parser into a cache, without rendering
+ * the help text
+ *
+ * Does nothing if the cache has no `widths` storage.
+ */
+void opthelp_measure(OptHelpCache* cache, OptParser const* parser);
+
 /** Parse command line options
+ *
+ * Compiles the option list on every call into storage on the stack sized by
+ * the list, so there is no limit on the number of options; use
+ * `optparser_compile` and `optparser_parse` to parse many command lines with
+ * the same options.
+ *
+ * Parses with the OPTPARSER_GROUP_ARGUMENTS flag, so options of a short group
+ * take the following arguments, and `-sf X` gives `-s` the argument X as it
+ * did before inline values; `-sX` needs a compiled parser without the flag.
+ *
+ * Parses with an internal state per thread: the response and config files
+ * mapped by a call stay mapped until the next call on the thread, or until
+ * `parse_opts_release`. The state has no arena, so append options fail with
+ * OPTERROR_NO_ARENA; use `optparser_parse` with `optparse_state_arena` for
+ * them.
  *
  * Sets an `err` output variable on error.
  *
@@ -73,12 +878,51 @@ typedef struct {
  */
 int parse_opts(OptionList* opts, int argc, char** argv, OptParserError* err);
 
+/** Release the files mapped by the last `parse_opts` call of the thread */
+void parse_opts_release(void);
+
+/** Build a long option lookup index
+ *
+ * `n_slots` must be a power of two greater than the number of options in the
+ * list. Once built, the index is used by `parse_opts` if it is assigned to
+ * `opts->index`, otherwise long options are looked up with a linear scan.
+ *
+ * @return 0 on success, -1 if `n_slots` is not suitable
+ */
+int optindex_build(OptIndex* index, OptionList const* opts, OptIndexSlot* slots, size_t n_slots);
+
+/** Build a long option lookup index over a compiled parser
+ *
+ * Same as `optindex_build`, for parsers that are not compiled from an option
+ * list at runtime, e.g. the ones generated by `optspec.h`.
+ *
+ * @return 0 on success, -1 if `n_slots` is not suitable
+ */
+int optindex_build_parser(OptIndex* index, OptParser const* parser, OptIndexSlot* slots, size_t n_slots);
+
+/** Build the sorted part of a long option index over a compiled parser
+ *
+ * `n_sorted` must not be less than the number of non-positional options with
+ * long names. Without hash slots, the sorted array is also used for exact
+ * lookups.
+ *
+ * @return 0 on success, -1 if `n_sorted` is not suitable
+ */
+int optindex_build_sorted(OptIndex* index, OptParser const* parser, Option const** sorted, size_t n_sorted);
+
 /** Print program usage */
 void print_usage(OptionList* opts, FILE* fout, char const* progname);
 
 /** Print more elaborate program usage with help strings */
 void print_help(OptionList* opts, FILE* fout);
 
+/** Print help strings of the options of a group, see `optparser_print_help_group` */
+void print_help_group(OptionList* opts, char const* group, FILE* fout);
+
+/** Print help strings of the long options starting with a prefix, see
+ * `optparser_print_help_prefix` */
+void print_help_prefix(OptionList* opts, char const* prefix, FILE* fout);
+
 /** Get a string representation of an error */
 char const* opterror_type_to_str(OptParserErrorType err_type);
 
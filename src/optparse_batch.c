@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "optparse_batch.h"
+
+typedef struct {
+  OptParser const* parser;
+  OptBatchItem* items;
+  size_t n_items;
+  size_t next;
+  size_t failed;
+} Batch;
+
+/* Parse chunks of the batch until there are none left */
+static void* batch_worker(void* arg);
+
+/* Get the number of workers for a batch */
+static unsigned batch_n_workers(unsigned n_threads, size_t n_items);
+
+size_t optparser_parse_batch(OptParser const* parser, OptBatchItem* items, size_t n_items, unsigned n_threads) {
+  assert(parser);
+  assert(items || n_items == 0);
+
+  Batch batch = {parser, items, n_items, 0, 0};
+  unsigned const n_workers = batch_n_workers(n_threads, n_items);
+
+  pthread_t threads[OPT_BATCH_MAX_THREADS];
+  unsigned n_started = 0;
+  for (; n_started + 1 < n_workers; ++n_started) {
+    /* if a thread cannot be created, the remaining chunks are parsed by the
+     * threads already running */
+    if (pthread_create(&threads[n_started], NULL, batch_worker, &batch) != 0)
+      break;
+  }
+
+  batch_worker(&batch);
+
+  for (unsigned i = 0; i < n_started; ++i)
+    pthread_join(threads[i], NULL);
+
+  return batch.failed;
+}
+
+void optparser_release_batch(OptBatchItem* items, size_t n_items) {
+  assert(items || n_items == 0);
+
+  for (size_t i = 0; i < n_items; ++i)
+    optparse_state_release(&items[i].state);
+}
+
+static void* batch_worker(void* arg) {
+  Batch* batch = arg;
+  size_t failed = 0;
+
+  for (;;) {
+    size_t const start = __atomic_fetch_add(&batch->next, OPT_BATCH_CHUNK, __ATOMIC_RELAXED);
+    if (start >= batch->n_items)
+      break;
+    size_t const end = start + OPT_BATCH_CHUNK < batch->n_items ? start + OPT_BATCH_CHUNK : batch->n_items;
+
+    for (size_t i = start; i < end; ++i) {
+      OptBatchItem* item = &batch->items[i];
+      item->err = (OptParserError){0};
+      optparse_state_init(&item->state, item->base);
+      if (item->arena)
+        optparse_state_arena(&item->state, item->arena, item->arena_size);
+      item->result = optparser_parse(batch->parser, &item->state, item->argc, item->argv, &item->err);
+      if (item->result == -1)
+        failed += 1;
+    }
+  }
+
+  __atomic_fetch_add(&batch->failed, failed, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static unsigned batch_n_workers(unsigned n_threads, size_t n_items) {
+  if (n_threads == 0) {
+    long const n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_cpus > 0 ? (unsigned)n_cpus : 1;
+  }
+  if (n_threads > OPT_BATCH_MAX_THREADS)
+    n_threads = OPT_BATCH_MAX_THREADS;
+
+  size_t const n_chunks = (n_items + OPT_BATCH_CHUNK - 1) / OPT_BATCH_CHUNK;
+  if (n_threads > n_chunks)
+    n_threads = n_chunks > 0 ? (unsigned)n_chunks : 1;
+
+  return n_threads;
+}
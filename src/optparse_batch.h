@@ -0,0 +1,61 @@
+#ifndef OPTPARSE_BATCH_H
+#define OPTPARSE_BATCH_H
+
+#include <stddef.h>
+
+#include "optparse.h"
+
+#if !defined(OPT_BATCH_MAX_THREADS)
+#define OPT_BATCH_MAX_THREADS 64
+#endif
+
+#if !defined(OPT_BATCH_CHUNK)
+#define OPT_BATCH_CHUNK 64
+#endif
+
+/** A single command line of a batch
+ *
+ * `base` is the destination storage of the item, see `OptParseState`. Items
+ * parsed by different threads must not share destinations, so options used in
+ * a batch should be declared with `Option.offset`.
+ *
+ * `arena` is the arena of the item for values of append options, see
+ * `optparse_state_arena`, or NULL if it has none. Items must not share arenas.
+ *
+ * `state` is the parse state of the item, initialized by the batch. It holds
+ * the response and config files mapped by the parse, which string values of
+ * the item point into, until `optparser_release_batch` is called.
+ */
+typedef struct {
+  int argc;
+  char** argv;
+  void* base;
+  void* arena;
+  size_t arena_size;
+  OptParserError err;
+  int result;
+  OptParseState state;
+} OptBatchItem;
+
+/** Parse a batch of command lines
+ *
+ * Items are distributed between `n_threads` workers in chunks of
+ * OPT_BATCH_CHUNK items, the calling thread is one of the workers. If
+ * `n_threads` is 0, one worker per online CPU is used. The number of workers
+ * is limited by OPT_BATCH_MAX_THREADS.
+ *
+ * Every item gets the return value of `optparser_parse` in `result` and its
+ * error in `err`.
+ *
+ * @return the number of items that failed to parse
+ */
+size_t optparser_parse_batch(OptParser const* parser, OptBatchItem* items, size_t n_items, unsigned n_threads);
+
+/** Release the files mapped by the parses of a batch
+ *
+ * Must be called before the items are parsed again or discarded, since a
+ * batch initializes the item states.
+ */
+void optparser_release_batch(OptBatchItem* items, size_t n_items);
+
+#endif
@@ -0,0 +1,203 @@
+/* Compile-time option spec
+ *
+ * Generates a compiled `OptParser` as static const data, so a program does no
+ * option setup at startup. Options are described by an X-macro list taking two
+ * entry macros: OPT for non-positional options and POS for positionals. The
+ * first argument of an entry is an enumerator naming the option. OPT takes the
+ * short name (0 for none), whether the option is required and its environment
+ * variable name (NULL for none) next. The rest are `Option` designated
+ * initializers:
+ *
+ *   #define DEMO_OPTIONS(OPT, POS)                                                           \
+ *     OPT(DEMO_FOO, 'f', false, NULL, .lname = "foo", .type = OPTION_FLAG,                     \
+ *         .offset = offsetof(Args, foo))                                                       \
+ *     OPT(DEMO_OUT, 'o', true, "DEMO_OUT", .lname = "out", .offset = offsetof(Args, out)) \
+ *     POS(DEMO_PATH, .lname = "path", .offset = offsetof(Args, path))
+ *
+ *   #define OPTSPEC_NAME demo_parser
+ *   #define OPTSPEC_LIST DEMO_OPTIONS
+ *   #include "optspec.h"
+ *
+ * This defines, with internal linkage:
+ *
+ * - an enum with the option names, numbered by their position in the order,
+ *   and `<name>_N_OPTIONS`;
+ * - `<name>_options`, the option table indexed by the enum;
+ * - `<name>_index`, an empty long option index of the parser, which can be
+ *   filled at runtime by `optindex_build_parser` with caller-provided slots;
+ * - `<name>_help`, an empty help cache of the parser with room for the name
+ *   column widths, which can be filled at runtime by `opthelp_build` with a
+ *   caller-provided buffer;
+ * - `<name>`, the parser.
+ *
+ * OPTSPEC_FLAGS can be defined to set the parser flags, and OPTSPEC_CONFIG to
+ * the enumerator of the OPTION_CONFIG option.
+ *
+ * Unlike `optparser_compile`, the header cannot check that OPTION_CALLBACK and
+ * OPTION_LAZY entries set `.convert`, so they must not leave it NULL.
+ *
+ * Non-positional options are ordered before positionals; the positional order,
+ * the short option table and the required and environment option masks are
+ * computed by the compiler, the masks if the parser has at most 1024 options,
+ * otherwise they are scanned for. Two options with the same short name are a
+ * compile error (a duplicate case label). The long name keys cannot be
+ * computed, since long names are only known inside the initializers, so long
+ * options are looked up through the index if it is built, which
+ * `optindex_build_parser` does once at startup, or by a scan. The
+ * header can be included several times with different names.
+ */
+
+#include "optparse.h"
+
+#if !defined(OPTSPEC_NAME) || !defined(OPTSPEC_LIST)
+#error "OPTSPEC_NAME and OPTSPEC_LIST must be defined before including optspec.h"
+#endif
+
+#if !defined(OPTSPEC_FLAGS)
+#define OPTSPEC_FLAGS 0
+#endif
+
+#define OPTSPEC_CAT_(A, B) A##B
+#define OPTSPEC_CAT(A, B) OPTSPEC_CAT_(A, B)
+
+#if !defined(OPTSPEC_MAX_WORDS_)
+/* Option mask words, a word W is ORed from the bits OPTSPEC_BIT<W>_ gives by
+ * the option, with OPTSPEC_SET_ selecting the options of the mask. Words past
+ * the mask are clamped to its last word and repeat its value. */
+#define OPTSPEC_MAX_WORDS_ 16
+#define OPTSPEC_WORD_(W) ((W) < OPTSPEC_WORDS_ ? (W) : OPTSPEC_WORDS_ - 1)
+#define OPTSPEC_BIT_(W, ID, SET) | ((SET) && (ID) / 64 == OPTSPEC_WORD_(W) ? (uint64_t)1 << (ID) % 64 : 0)
+#define OPTSPEC_BIT0_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(0, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT1_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(1, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT2_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(2, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT3_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(3, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT4_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(4, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT5_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(5, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT6_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(6, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT7_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(7, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT8_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(8, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT9_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(9, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT10_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(10, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT11_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(11, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT12_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(12, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT13_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(13, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT14_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(14, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_BIT15_(ID, SNAME, REQUIRED, ENV, ...) OPTSPEC_BIT_(15, ID, OPTSPEC_SET_(REQUIRED, ENV))
+#define OPTSPEC_MASK_WORD_(W) [OPTSPEC_WORD_(W)] = 0 OPTSPEC_LIST(OPTSPEC_BIT##W##_, OPTSPEC_SKIP_),
+#define OPTSPEC_MASK_                                                                                                  \
+  {                                                                                                                    \
+    OPTSPEC_MASK_WORD_(0) OPTSPEC_MASK_WORD_(1) OPTSPEC_MASK_WORD_(2) OPTSPEC_MASK_WORD_(3) OPTSPEC_MASK_WORD_(4)      \
+    OPTSPEC_MASK_WORD_(5) OPTSPEC_MASK_WORD_(6) OPTSPEC_MASK_WORD_(7) OPTSPEC_MASK_WORD_(8) OPTSPEC_MASK_WORD_(9)      \
+    OPTSPEC_MASK_WORD_(10) OPTSPEC_MASK_WORD_(11) OPTSPEC_MASK_WORD_(12) OPTSPEC_MASK_WORD_(13)                        \
+    OPTSPEC_MASK_WORD_(14) OPTSPEC_MASK_WORD_(15)                                                                      \
+  }
+#endif
+
+#define OPTSPEC_TABLE_ OPTSPEC_CAT(OPTSPEC_NAME, _options)
+#define OPTSPEC_INDEX_ OPTSPEC_CAT(OPTSPEC_NAME, _index)
+#define OPTSPEC_HELP_ OPTSPEC_CAT(OPTSPEC_NAME, _help)
+#define OPTSPEC_ORDER_TABLE_ OPTSPEC_CAT(OPTSPEC_NAME, _order_)
+#define OPTSPEC_REQUIRED_ OPTSPEC_CAT(OPTSPEC_NAME, _required_)
+#define OPTSPEC_ENVS_ OPTSPEC_CAT(OPTSPEC_NAME, _envs_)
+#define OPTSPEC_WIDTHS_ OPTSPEC_CAT(OPTSPEC_NAME, _widths_)
+#define OPTSPEC_WORDS_ OPTSPEC_CAT(OPTSPEC_NAME, _WORDS_)
+#define OPTSPEC_HAS_MASKS_ OPTSPEC_CAT(OPTSPEC_NAME, _HAS_MASKS_)
+#define OPTSPEC_N_FLAGS_ OPTSPEC_CAT(OPTSPEC_NAME, _N_FLAGS_)
+#define OPTSPEC_N_OPTIONS_ OPTSPEC_CAT(OPTSPEC_NAME, _N_OPTIONS)
+
+#define OPTSPEC_SKIP_(...)
+#define OPTSPEC_ID_(ID, ...) ID,
+#define OPTSPEC_OPTION_(ID, SNAME, REQUIRED, ENV, ...)                                                                 \
+  [ID] = {.sname = SNAME, .required = REQUIRED, .env = ENV, __VA_ARGS__},
+#define OPTSPEC_POSITIONAL_(ID, ...) [ID] = {.type = OPTION_POSITIONAL, __VA_ARGS__},
+#define OPTSPEC_ORDER_(ID, ...) &OPTSPEC_TABLE_[ID],
+#define OPTSPEC_SHORT_(ID, SNAME, ...) [(unsigned char)(SNAME)] = (SNAME) ? &OPTSPEC_TABLE_[ID] : NULL,
+/* options without a short name get distinct negative labels */
+#define OPTSPEC_SHORT_CASE_(ID, SNAME, ...)                                                                            \
+  case (SNAME) ? (int)(unsigned char)(SNAME) : -1 - (int)(ID):                                                         \
+    break;
+
+enum {
+  OPTSPEC_LIST(OPTSPEC_ID_, OPTSPEC_SKIP_) OPTSPEC_N_FLAGS_,
+  OPTSPEC_CAT(OPTSPEC_NAME, _POS_BASE_) = OPTSPEC_N_FLAGS_ - 1,
+  OPTSPEC_LIST(OPTSPEC_SKIP_, OPTSPEC_ID_) OPTSPEC_N_OPTIONS_
+};
+
+/* mask words, at least one so the mask arrays are not empty */
+enum {
+  OPTSPEC_HAS_MASKS_ = (OPTSPEC_N_OPTIONS_ + 63) / 64 <= OPTSPEC_MAX_WORDS_,
+  OPTSPEC_WORDS_ = OPTSPEC_HAS_MASKS_ && OPTSPEC_N_OPTIONS_ > 0 ? (OPTSPEC_N_OPTIONS_ + 63) / 64 : 1
+};
+
+static Option const OPTSPEC_TABLE_[] = {OPTSPEC_LIST(OPTSPEC_OPTION_, OPTSPEC_POSITIONAL_)};
+
+static Option const* const OPTSPEC_ORDER_TABLE_[] = {OPTSPEC_LIST(OPTSPEC_ORDER_, OPTSPEC_SKIP_)
+                                                         OPTSPEC_LIST(OPTSPEC_SKIP_, OPTSPEC_ORDER_)};
+
+static OptIndex OPTSPEC_INDEX_;
+
+static uint16_t OPTSPEC_WIDTHS_[OPTSPEC_N_OPTIONS_];
+
+static OptHelpCache OPTSPEC_HELP_ = {.widths = OPTSPEC_WIDTHS_};
+
+/* Never called: two options with the same short name are a duplicate case
+ * label, so they fail to compile instead of the later one silently taking the
+ * slot of the earlier one in the short option table */
+static inline void OPTSPEC_CAT(OPTSPEC_NAME, _check_shorts_)(int c) {
+  switch (c) {
+    OPTSPEC_LIST(OPTSPEC_SHORT_CASE_, OPTSPEC_SKIP_)
+  default:
+    break;
+  }
+}
+
+/* options without a short name all set the unused slot 0 to NULL, duplicates
+ * of other slots are rejected above; clamped mask words repeat the last one */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+#define OPTSPEC_SET_(REQUIRED, ENV) (REQUIRED)
+static uint64_t const OPTSPEC_REQUIRED_[OPTSPEC_WORDS_] = OPTSPEC_MASK_;
+#undef OPTSPEC_SET_
+#define OPTSPEC_SET_(REQUIRED, ENV) ((ENV) != NULL)
+static uint64_t const OPTSPEC_ENVS_[OPTSPEC_WORDS_] = OPTSPEC_MASK_;
+#undef OPTSPEC_SET_
+
+static OptParser const OPTSPEC_NAME = {
+    .order = OPTSPEC_ORDER_TABLE_,
+    .n_options = OPTSPEC_N_OPTIONS_,
+    .n_positionals = OPTSPEC_N_OPTIONS_ - OPTSPEC_N_FLAGS_,
+    .table = OPTSPEC_TABLE_,
+    .index = &OPTSPEC_INDEX_,
+    .help_cache = &OPTSPEC_HELP_,
+    .shorts = {OPTSPEC_LIST(OPTSPEC_SHORT_, OPTSPEC_SKIP_)},
+    .flags = OPTSPEC_FLAGS,
+    .required = OPTSPEC_HAS_MASKS_ ? OPTSPEC_REQUIRED_ : NULL,
+    .envs = OPTSPEC_HAS_MASKS_ ? OPTSPEC_ENVS_ : NULL,
+#if defined(OPTSPEC_CONFIG)
+    .config = &OPTSPEC_TABLE_[OPTSPEC_CONFIG],
+#endif
+};
+#pragma GCC diagnostic pop
+
+#undef OPTSPEC_TABLE_
+#undef OPTSPEC_INDEX_
+#undef OPTSPEC_HELP_
+#undef OPTSPEC_ORDER_TABLE_
+#undef OPTSPEC_REQUIRED_
+#undef OPTSPEC_ENVS_
+#undef OPTSPEC_WIDTHS_
+#undef OPTSPEC_WORDS_
+#undef OPTSPEC_HAS_MASKS_
+#undef OPTSPEC_N_FLAGS_
+#undef OPTSPEC_N_OPTIONS_
+#undef OPTSPEC_SKIP_
+#undef OPTSPEC_ID_
+#undef OPTSPEC_OPTION_
+#undef OPTSPEC_POSITIONAL_
+#undef OPTSPEC_ORDER_
+#undef OPTSPEC_SHORT_
+#undef OPTSPEC_SHORT_CASE_
+#undef OPTSPEC_NAME
+#undef OPTSPEC_LIST
+#undef OPTSPEC_FLAGS
+#undef OPTSPEC_CONFIG
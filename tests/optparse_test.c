@@ -0,0 +1,1557 @@
+/* Parser tests
+ *
+ * Every test parses an argument vector with a small compiled spec and checks
+ * the destinations and the error. The program exits with a non-zero status if
+ * any check fails.
+ *
+ * Usage: optparse_test
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "optparse.h"
+#include "optparse_batch.h"
+
+typedef struct {
+  char const* req;
+  char const* env;
+  char const* path;
+} SpecArgs;
+
+/* A generated spec with 64 flags before a required and an environment option,
+ * so their mask bits are in the second word */
+#define SPEC_FLAGS8_(OPT, P)                                                                                           \
+  OPT(P##0, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##1, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##2, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##3, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##4, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##5, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##6, 0, false, NULL, .type = OPTION_FLAG)                                                                       \
+  OPT(P##7, 0, false, NULL, .type = OPTION_FLAG)
+#define SPEC_FLAGS64_(OPT, P)                                                                                          \
+  SPEC_FLAGS8_(OPT, P##0)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##1)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##2)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##3)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##4)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##5)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##6)                                                                                              \
+  SPEC_FLAGS8_(OPT, P##7)
+#define SPEC_OPTIONS(OPT, POS)                                                                                         \
+  SPEC_FLAGS64_(OPT, SPEC_FLAG)                                                                                        \
+  OPT(SPEC_REQ, 'r', true, NULL, .lname = "req", .type = OPTION_STORE_STR, .offset = offsetof(SpecArgs, req))          \
+  POS(SPEC_PATH, .lname = "path", .offset = offsetof(SpecArgs, path))                                                  \
+  OPT(SPEC_ENV, 'e', false, "OPTPARSE_TEST_ENV", .lname = "env", .type = OPTION_STORE_STR,                             \
+      .offset = offsetof(SpecArgs, env))
+
+#define OPTSPEC_NAME spec_parser
+#define OPTSPEC_LIST SPEC_OPTIONS
+#include "optspec.h"
+
+#define MAX_ARGS 8
+#define ARG_LEN 32
+
+#define CHECK(COND)                                                                                                    \
+  do {                                                                                                                 \
+    if (!(COND)) {                                                                                                     \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #COND);                           \
+      failures += 1;                                                                                                   \
+    }                                                                                                                  \
+  } while (0)
+
+#define CHECK_STR(A, B) CHECK((A) && strcmp((A), (B)) == 0)
+
+typedef struct {
+  bool flag;
+  char const* str;
+  char const* value;
+  char const* path;
+  char const* config;
+} Args;
+
+/* Spec with a flag -f, string options -s and -v, a config file option and a
+ * positional path */
+typedef struct {
+  Option opts[5];
+  OptionList list;
+  OptParser parser;
+  uint64_t parser_data[32];
+  OptParseState state;
+  Args args;
+  OptParserError err;
+  char storage[MAX_ARGS][ARG_LEN];
+  char* argv[MAX_ARGS];
+} Fixture;
+
+static int failures = 0;
+
+/* Compile the spec with the given parser flags */
+static void fixture_init(Fixture* fx, unsigned flags);
+
+/* Parse the NULL-terminated arguments, which follow the program name */
+static int fixture_parse(Fixture* fx, ...);
+
+/* Create a temporary file with the given contents, the path is written to
+ * `path`, which must hold ARG_LEN bytes */
+static bool write_temp(char* path, char const* data);
+
+/* Count the memory mappings of the process, -1 if they cannot be listed */
+static int count_mappings(void);
+
+/* Print usage, help and the help of the group "io" and the prefix "s" into a
+ * memory stream, the text is written to `out` of `size` bytes */
+static void print_all_help(OptParser const* parser, char* out, size_t size);
+
+/* Answer a completion request for the space-separated words of `line` with
+ * the cursor on word `index`, the candidates are written to `out` of `size`
+ * bytes */
+static int complete_line(OptParser const* parser, OptCommand const* commands, size_t n_commands, int index,
+                         char const* line, char* out, size_t size);
+
+/* Load a copy of a snapshot with the byte at `offset` set to `byte`, or the
+ * 64-bit word at `offset` set to `word` if `byte` is negative, and with
+ * `size` bytes of it, of which `header_size` are recorded in the header */
+static int load_corrupt(OptParser const* parser, OptParseState* state, uint64_t const* snapshot, size_t size,
+                        size_t header_size, size_t offset, int byte, uint64_t word, OptParserError* err);
+
+/* Parse "--value=VALUE" with a single option of the type, which stores into
+ * `dest`, with an arena for list options */
+static int parse_value(OptionType type, char const* value, void* dest, OptParserError* err);
+
+/* Subcommand setup returning the parser of the fixture in `ctx` */
+static OptParser const* fixture_setup(OptCommand const* command, OptParseState* state);
+
+static void test_flag_group(void);
+static void test_group_value_last(void);
+static void test_group_value_inline(void);
+static void test_group_value_rest(void);
+static void test_group_value_missing(void);
+static void test_group_arguments(void);
+static void test_group_arguments_flags(void);
+static void test_parse_opts_groups(void);
+static void test_batch_response_files(void);
+static void test_reused_state_files(void);
+static void test_parse_opts_files(void);
+static void test_command_state(void);
+static void test_complete(void);
+static void test_stop_flags(void);
+static void test_response_file_empty_tokens(void);
+static void test_arena_alignment(void);
+static void test_no_arena(void);
+static void test_missing_converter(void);
+static void test_double_locale(void);
+static void test_numbers(void);
+static void test_doubles(void);
+static void test_int_list(void);
+static void test_optspec_masks(void);
+static void test_many_options(void);
+static void test_option_positions(void);
+static void test_iter_argv(void);
+static void test_iter_nul_stream(void);
+static void test_help_cache(void);
+static void test_help_filters(void);
+static void test_lookup_paths(void);
+static void test_short_table(void);
+static void test_abbreviations(void);
+static void test_suggestions(void);
+static void test_collect_errors(void);
+static void test_snapshot(void);
+#if defined(OPT_STATS)
+static void count_stats(OptStats const* stats, void* ctx);
+static void test_stats(void);
+#endif
+
+int main(void) {
+  test_flag_group();
+  test_group_value_last();
+  test_group_value_inline();
+  test_group_value_rest();
+  test_group_value_missing();
+  test_group_arguments();
+  test_group_arguments_flags();
+  test_parse_opts_groups();
+  test_batch_response_files();
+  test_reused_state_files();
+  test_parse_opts_files();
+  test_command_state();
+  test_complete();
+  test_stop_flags();
+  test_response_file_empty_tokens();
+  test_arena_alignment();
+  test_no_arena();
+  test_missing_converter();
+  test_double_locale();
+  test_numbers();
+  test_doubles();
+  test_int_list();
+  test_optspec_masks();
+  test_many_options();
+  test_option_positions();
+  test_iter_argv();
+  test_iter_nul_stream();
+  test_help_cache();
+  test_help_filters();
+  test_lookup_paths();
+  test_short_table();
+  test_abbreviations();
+  test_suggestions();
+  test_collect_errors();
+  test_snapshot();
+#if defined(OPT_STATS)
+  test_stats();
+#endif
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
+
+static void fixture_init(Fixture* fx, unsigned flags) {
+  *fx = (Fixture){
+      .opts =
+          {
+              {.lname = "flag", .sname = 'f', .type = OPTION_FLAG, .offset = offsetof(Args, flag)},
+              {.lname = "str", .sname = 's', .type = OPTION_STORE_STR, .offset = offsetof(Args, str)},
+              {.lname = "value", .sname = 'v', .type = OPTION_STORE_STR, .offset = offsetof(Args, value)},
+              {.lname = "config", .type = OPTION_CONFIG, .offset = offsetof(Args, config)},
+              {.lname = "path", .type = OPTION_POSITIONAL, .offset = offsetof(Args, path)},
+          },
+  };
+  OPTLIST_INIT(fx->list, fx->opts[0]);
+  for (size_t i = 1; i < sizeof(fx->opts) / sizeof(*fx->opts); ++i)
+    OPTLIST_ADD(fx->list, fx->opts[i]);
+  optparser_compile(&fx->parser, &fx->list, fx->parser_data, sizeof(fx->parser_data));
+  fx->parser.flags = flags;
+  optparse_state_init(&fx->state, &fx->args);
+}
+
+static int fixture_parse(Fixture* fx, ...) {
+  va_list ap;
+  va_start(ap, fx);
+  int argc = 0;
+  for (char const* arg = "prog"; arg && argc < MAX_ARGS - 1; arg = va_arg(ap, char const*)) {
+    snprintf(fx->storage[argc], ARG_LEN, "%s", arg);
+    fx->argv[argc] = fx->storage[argc];
+    argc += 1;
+  }
+  va_end(ap);
+  fx->argv[argc] = NULL;
+
+  int const ret = optparser_parse(&fx->parser, &fx->state, argc, fx->argv, &fx->err);
+  optparse_state_release(&fx->state);
+  return ret;
+}
+
+static bool write_temp(char* path, char const* data) {
+  snprintf(path, ARG_LEN, "/tmp/optparse_test_XXXXXX");
+  int const fd = mkstemp(path);
+  if (fd == -1)
+    return false;
+  size_t const len = strlen(data);
+  bool const ok = write(fd, data, len) == (ssize_t)len;
+  close(fd);
+  return ok;
+}
+
+static int count_mappings(void) {
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (!maps)
+    return -1;
+  int count = 0;
+  for (int c; (c = fgetc(maps)) != EOF;)
+    count += c == '\n';
+  fclose(maps);
+  return count;
+}
+
+static int parse_value(OptionType type, char const* value, void* dest, OptParserError* err) {
+  Option opt = {.lname = "value", .type = type};
+  OptionList list;
+  OPTLIST_INIT(list, opt);
+  OptParser parser;
+  uint64_t data[32];
+  if (optparser_compile(&parser, &list, data, sizeof(data)) != 0)
+    return -1;
+
+  static long arena[64];
+  OptParseState state;
+  optparse_state_init(&state, dest);
+  optparse_state_arena(&state, arena, sizeof(arena));
+  char prog[] = "prog";
+  char arg[96];
+  snprintf(arg, sizeof(arg), "--value=%s", value);
+  char* argv[] = {prog, arg, NULL};
+  *err = (OptParserError){0};
+  int const ret = optparser_parse(&parser, &state, 2, argv, err);
+  optparse_state_release(&state);
+  return ret;
+}
+
+static int complete_line(OptParser const* parser, OptCommand const* commands, size_t n_commands, int index,
+                         char const* line, char* out, size_t size) {
+  char words[MAX_ARGS * ARG_LEN];
+  snprintf(words, sizeof(words), "%s", line);
+  char option[] = OPT_COMPLETE_ARG;
+  char number[16];
+  snprintf(number, sizeof(number), "%d", index);
+  char* argv[MAX_ARGS + 3] = {words, option, number};
+  int argc = 3;
+  for (char* word = strtok(words, " "); word && argc < MAX_ARGS + 2; word = strtok(NULL, " "))
+    argv[argc++] = word;
+  argv[0] = argv[3];
+
+  /* an empty answer writes nothing into the stream */
+  out[0] = '\0';
+  FILE* fout = fmemopen(out, size, "w");
+  int const ret = optparser_complete(parser, commands, n_commands, argc, argv, fout);
+  fclose(fout);
+  return ret;
+}
+
+static OptParser const* fixture_setup(OptCommand const* command, OptParseState* state) {
+  Fixture* fx = command->ctx;
+  state->base = &fx->args;
+  return &fx->parser;
+}
+
+static void test_flag_group(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-f", "P", NULL) == 0);
+  CHECK(fx.args.flag);
+  CHECK(fx.args.str == NULL);
+  CHECK_STR(fx.args.path, "P");
+}
+
+/* an option taking an argument last in a group takes the next argument */
+static void test_group_value_last(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-fs", "X", "P", NULL) == 0);
+  CHECK(fx.args.flag);
+  CHECK_STR(fx.args.str, "X");
+  CHECK_STR(fx.args.path, "P");
+}
+
+static void test_group_value_inline(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-sX", "P", NULL) == 0);
+  CHECK_STR(fx.args.str, "X");
+  CHECK_STR(fx.args.path, "P");
+}
+
+/* the rest of the group is the argument even if it names options, so the
+ * next argument is a positional; before inline values -f was a flag and -s
+ * took X */
+static void test_group_value_rest(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-sf", "X", NULL) == 0);
+  CHECK(!fx.args.flag);
+  CHECK_STR(fx.args.str, "f");
+  CHECK_STR(fx.args.path, "X");
+
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-svA", "P", NULL) == 0);
+  CHECK_STR(fx.args.str, "vA");
+  CHECK(fx.args.value == NULL);
+}
+
+static void test_group_value_missing(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-fs", NULL) == -1);
+  CHECK(fx.err.type == OPTERROR_ARGUMENT_REQUIRED);
+  CHECK_STR(fx.err.opt, "-fs");
+}
+
+/* with OPTPARSER_GROUP_ARGUMENTS the options take the next arguments in
+ * order, where a second one was an OPTERROR_ONE_ARG_OPT_PER_GROUP error */
+static void test_group_arguments(void) {
+  Fixture fx;
+  fixture_init(&fx, OPTPARSER_GROUP_ARGUMENTS);
+  CHECK(fixture_parse(&fx, "-sv", "A", "B", "P", NULL) == 0);
+  CHECK_STR(fx.args.str, "A");
+  CHECK_STR(fx.args.value, "B");
+  CHECK_STR(fx.args.path, "P");
+
+  fixture_init(&fx, OPTPARSER_GROUP_ARGUMENTS);
+  CHECK(fixture_parse(&fx, "-sv", "A", NULL) == -1);
+  CHECK(fx.err.type == OPTERROR_ARGUMENT_REQUIRED);
+  CHECK_STR(fx.err.opt, "-sv");
+}
+
+/* OPTPARSER_GROUP_ARGUMENTS keeps the meaning of -sf X from before inline
+ * values */
+static void test_group_arguments_flags(void) {
+  Fixture fx;
+  fixture_init(&fx, OPTPARSER_GROUP_ARGUMENTS);
+  CHECK(fixture_parse(&fx, "-sf", "X", "P", NULL) == 0);
+  CHECK(fx.args.flag);
+  CHECK_STR(fx.args.str, "X");
+  CHECK_STR(fx.args.path, "P");
+}
+
+/* parse_opts keeps the meaning of -sf X */
+static void test_parse_opts_groups(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  for (size_t i = 0; i < sizeof(fx.opts) / sizeof(*fx.opts); ++i) {
+    fx.opts[i].dest = (char*)&fx.args + fx.opts[i].offset;
+    fx.opts[i].offset = 0;
+  }
+  char prog[] = "prog";
+  char group[] = "-sf";
+  char x[] = "X";
+  char path[] = "P";
+  char* argv[] = {prog, group, x, path, NULL};
+  CHECK(parse_opts(&fx.list, 4, argv, &fx.err) == 0);
+  CHECK(fx.args.flag);
+  CHECK_STR(fx.args.str, "X");
+  CHECK_STR(fx.args.path, "P");
+  parse_opts_release();
+}
+
+/* values from response files stay valid until the batch is released, which
+ * unmaps the files of every item; a single worker is used, so no thread
+ * stacks are left mapped */
+static void test_batch_response_files(void) {
+  char path[ARG_LEN];
+  CHECK(write_temp(path, "-s FILE"));
+
+  Fixture fx;
+  fixture_init(&fx, OPTPARSER_RESPONSE_FILES);
+  char at_path[ARG_LEN + 1];
+  snprintf(at_path, sizeof(at_path), "@%s", path);
+  char prog[] = "prog";
+  char positional[] = "P";
+  char* argv[OPT_MAX_RESPONSE_FILES + 2] = {prog, positional};
+  for (int i = 2; i < OPT_MAX_RESPONSE_FILES + 2; ++i)
+    argv[i] = at_path;
+
+  enum { N_ITEMS = 3 * OPT_BATCH_CHUNK };
+  static OptBatchItem items[N_ITEMS];
+  static Args args[N_ITEMS];
+  for (size_t i = 0; i < N_ITEMS; ++i)
+    items[i] = (OptBatchItem){.argc = OPT_MAX_RESPONSE_FILES + 2, .argv = argv, .base = &args[i]};
+
+  int const n_mappings = count_mappings();
+  CHECK(optparser_parse_batch(&fx.parser, items, N_ITEMS, 1) == 0);
+  unlink(path);
+  for (size_t i = 0; i < N_ITEMS; ++i) {
+    CHECK(items[i].result == 0);
+    CHECK_STR(args[i].str, "FILE");
+  }
+  optparser_release_batch(items, N_ITEMS);
+  CHECK(count_mappings() <= n_mappings);
+}
+
+/* every parse unmaps the files of the previous one, so a state can be reused
+ * for any number of parses with response and config files */
+static void test_reused_state_files(void) {
+  char response[ARG_LEN];
+  char config[ARG_LEN];
+  CHECK(write_temp(response, "-s FILE"));
+  CHECK(write_temp(config, "value = CONFIG"));
+
+  Fixture fx;
+  fixture_init(&fx, OPTPARSER_RESPONSE_FILES);
+  int const n_mappings = count_mappings();
+  for (int i = 0; i < 4 * OPT_MAX_RESPONSE_FILES; ++i) {
+    fx.args = (Args){.config = config};
+    char at_path[ARG_LEN + 1];
+    snprintf(at_path, sizeof(at_path), "@%s", response);
+    char prog[] = "prog";
+    char positional[] = "P";
+    char* argv[] = {prog, at_path, positional, NULL};
+    CHECK(optparser_parse(&fx.parser, &fx.state, 3, argv, &fx.err) == 0);
+    CHECK_STR(fx.args.str, "FILE");
+    CHECK_STR(fx.args.value, "CONFIG");
+  }
+  optparse_state_release(&fx.state);
+  CHECK(count_mappings() <= n_mappings);
+  unlink(response);
+  unlink(config);
+}
+
+static void test_parse_opts_files(void) {
+  char config[ARG_LEN];
+  CHECK(write_temp(config, "value = CONFIG"));
+
+  Fixture fx;
+  fixture_init(&fx, 0);
+  int const n_mappings = count_mappings();
+  for (int i = 0; i < 4 * OPT_MAX_RESPONSE_FILES; ++i) {
+    fx.args = (Args){.config = config};
+    for (size_t k = 0; k < sizeof(fx.opts) / sizeof(*fx.opts); ++k)
+      fx.opts[k].dest = (char*)&fx.args + fx.opts[k].offset;
+    char prog[] = "prog";
+    char positional[] = "P";
+    char* argv[] = {prog, positional, NULL};
+    CHECK(parse_opts(&fx.list, 2, argv, &fx.err) == 0);
+    CHECK_STR(fx.args.value, "CONFIG");
+  }
+  parse_opts_release();
+  CHECK(count_mappings() <= n_mappings);
+  unlink(config);
+}
+
+/* the subcommand state is initialized before setup, which only sets the base */
+static void test_command_state(void) {
+  Fixture global;
+  fixture_init(&global, 0);
+  Fixture fx;
+  fixture_init(&fx, 0);
+  OptCommand const commands[] = {{.name = "run", .setup = fixture_setup, .ctx = &fx}};
+
+  OptParseState command_state;
+  memset(&command_state, 0xa5, sizeof(command_state));
+  char prog[] = "prog";
+  char global_path[] = "G";
+  char run[] = "run";
+  char flag[] = "-f";
+  char path[] = "P";
+  char* argv[] = {prog, global_path, run, flag, path, NULL};
+  OptCommand const* command;
+  CHECK(optparser_parse_command(&global.parser, &global.state, commands, 1, &command_state, 5, argv, &command,
+                                &global.err) == 0);
+  CHECK(command == &commands[0]);
+  CHECK_STR(global.args.path, "G");
+  CHECK(fx.args.flag);
+  CHECK_STR(fx.args.path, "P");
+  optparse_state_release(&command_state);
+  optparse_state_release(&global.state);
+}
+
+/* completion prints the options and subcommands starting with the word under
+ * the cursor, or the metavar of the option taking it as an argument */
+static void test_complete(void) {
+  Fixture global;
+  fixture_init(&global, 0);
+  Fixture fx;
+  fixture_init(&fx, 0);
+  fx.opts[1].metavar = "TEXT";
+  OptCommand const commands[] = {
+      {.name = "run", .setup = fixture_setup, .ctx = &fx},
+      {.name = "rebuild", .setup = fixture_setup, .ctx = &fx},
+  };
+
+  struct {
+    int index;
+    char const* line;
+    char const* out;
+  } const cases[] = {
+      {1, "prog --v", "--value\n"},
+      {1, "prog --", "--flag\n--str\n--value\n--config\n"},
+      {1, "prog -", "-f\n-s\n-v\n--flag\n--str\n--value\n--config\n"},
+      {2, "prog -s", ":str\n"},
+      {2, "prog -fs", ":str\n"},
+      {2, "prog -fsX", "run\nrebuild\n"},
+      {1, "prog --value=", ":value\n"},
+      {2, "prog G r", "run\nrebuild\n"},
+      {2, "prog G re", "rebuild\n"},
+      {3, "prog G run --s", "--str\n"},
+      {4, "prog G run --str", ":TEXT\n"},
+      {2, "prog -- -", ""},
+      {5, "prog --", ""},
+  };
+  char out[256];
+  for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i) {
+    CHECK(complete_line(&global.parser, commands, 2, cases[i].index, cases[i].line, out, sizeof(out)) == 1);
+    CHECK(strcmp(out, cases[i].out) == 0);
+  }
+
+  /* a sorted index lists long options by name */
+  Option const* sorted[4];
+  OptIndex index = {0};
+  CHECK(optindex_build_sorted(&index, &global.parser, sorted, 4) == 0);
+  OptParser by_sort = global.parser;
+  by_sort.index = &index;
+  CHECK(complete_line(&by_sort, NULL, 0, 1, "prog --", out, sizeof(out)) == 1);
+  CHECK(strcmp(out, "--config\n--flag\n--str\n--value\n") == 0);
+  CHECK(complete_line(&by_sort, NULL, 0, 1, "prog --f", out, sizeof(out)) == 1);
+  CHECK(strcmp(out, "--flag\n") == 0);
+
+  char prog[] = "prog";
+  char flag[] = "-f";
+  char* argv[] = {prog, flag, NULL};
+  CHECK(optparser_complete(&global.parser, NULL, 0, 2, argv, stdout) == 0);
+}
+
+/* `--` ends options or the parse, a lone `-` is a positional, and the tail is
+ * the first argument left unparsed */
+static void test_stop_flags(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-f", "--", "-s", NULL) == 0);
+  CHECK(fx.args.flag && !fx.args.str && fx.state.tail == 4);
+  CHECK_STR(fx.args.path, "-s");
+
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "-", "-f", NULL) == 0);
+  CHECK(fx.args.flag && fx.state.tail == 3);
+  CHECK_STR(fx.args.path, "-");
+
+  fixture_init(&fx, 0);
+  CHECK(fixture_parse(&fx, "P", "Q", NULL) == -1 && fx.err.type == OPTERROR_UNEXPECTED_POSITIONAL);
+
+  fixture_init(&fx, OPTPARSER_STOP_AT_TERMINATOR);
+  CHECK(fixture_parse(&fx, "-f", "P", "--", "-s", "x", NULL) == 0);
+  CHECK(fx.args.flag && !fx.args.str && fx.state.tail == 4);
+  CHECK_STR(fx.args.path, "P");
+
+  /* the path is still required when the parse ends at `--` */
+  fixture_init(&fx, OPTPARSER_STOP_AT_TERMINATOR);
+  CHECK(fixture_parse(&fx, "--", "P", NULL) == -1 && fx.err.type == OPTERROR_EXPECTED_POSITIONAL);
+  fixture_init(&fx, OPTPARSER_STOP_AT_TERMINATOR);
+  CHECK(fixture_parse(&fx, "P", "--", NULL) == 0 && fx.state.tail == 3);
+
+  fixture_init(&fx, OPTPARSER_STOP_AT_POSITIONAL);
+  CHECK(fixture_parse(&fx, "P", "cmd", "-f", NULL) == 0);
+  CHECK(!fx.args.flag && fx.state.tail == 2);
+  CHECK_STR(fx.args.path, "P");
+
+  /* past `--` the first extra positional still stops the parse */
+  fixture_init(&fx, OPTPARSER_STOP_AT_POSITIONAL);
+  CHECK(fixture_parse(&fx, "--", "-P", "-f", NULL) == 0);
+  CHECK(!fx.args.flag && fx.state.tail == 3);
+  CHECK_STR(fx.args.path, "-P");
+
+  fixture_init(&fx, OPTPARSER_STOP_AT_TERMINATOR | OPTPARSER_STOP_AT_POSITIONAL);
+  CHECK(fixture_parse(&fx, "P", "--", "Q", NULL) == 0 && fx.state.tail == 3);
+  CHECK_STR(fx.args.path, "P");
+}
+
+/* empty quoted tokens of a response file are empty positionals and values */
+static void test_response_file_empty_tokens(void) {
+  char response[ARG_LEN];
+  CHECK(write_temp(response, "-s '' \"\""));
+
+  Fixture fx;
+  fixture_init(&fx, OPTPARSER_RESPONSE_FILES);
+  char at_path[ARG_LEN + 1];
+  snprintf(at_path, sizeof(at_path), "@%s", response);
+  char prog[] = "prog";
+  char* argv[] = {prog, at_path, NULL};
+  CHECK(optparser_parse(&fx.parser, &fx.state, 2, argv, &fx.err) == 0);
+  CHECK_STR(fx.args.str, "");
+  CHECK_STR(fx.args.path, "");
+  optparse_state_release(&fx.state);
+  unlink(response);
+}
+
+typedef struct {
+  OptStrList names;
+  OptIntList numbers;
+} ListArgs;
+
+/* list arrays are aligned inside an unaligned arena, also in batches */
+static void test_arena_alignment(void) {
+  Option opts[] = {
+      {.lname = "name", .sname = 'n', .type = OPTION_APPEND_STR, .offset = offsetof(ListArgs, names)},
+      {.lname = "number", .sname = 'i', .type = OPTION_APPEND_INT, .offset = offsetof(ListArgs, numbers)},
+  };
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  OPTLIST_ADD(list, opts[1]);
+  OptParser parser;
+  uint64_t data[16];
+  optparser_compile(&parser, &list, data, sizeof(data));
+
+  char n[] = "-nA";
+  char i1[] = "-i1";
+  char i2[] = "-i2";
+  char prog[] = "prog";
+  char* argv[] = {prog, n, i1, n, i2, NULL};
+  /* aligned storage, the arena starts one byte into it */
+  static union {
+    char bytes[257];
+    long align;
+  } storage;
+  char* const arena = storage.bytes + 1;
+
+  ListArgs args = {0};
+  OptParseState state;
+  optparse_state_init(&state, &args);
+  optparse_state_arena(&state, arena, sizeof(storage.bytes) - 1);
+  OptParserError err = {0};
+  CHECK(optparser_parse(&parser, &state, 5, argv, &err) == 0);
+  CHECK(args.names.count == 2 && (uintptr_t)args.names.items % sizeof(char const*) == 0);
+  CHECK(args.numbers.count == 2 && (uintptr_t)args.numbers.items % sizeof(long) == 0);
+  CHECK(args.numbers.items[0] == 1 && args.numbers.items[1] == 2);
+  optparse_state_release(&state);
+
+  ListArgs item_args = {0};
+  OptBatchItem item = {.argc = 5, .argv = argv, .base = &item_args, .arena = arena, .arena_size = 16};
+  CHECK(optparser_parse_batch(&parser, &item, 1, 1) == 1);
+  CHECK(item.err.type == OPTERROR_ARENA_FULL);
+  item.arena_size = sizeof(storage.bytes) - 1;
+  CHECK(optparser_parse_batch(&parser, &item, 1, 1) == 0);
+  CHECK(item_args.names.count == 2 && (uintptr_t)item_args.names.items % sizeof(char const*) == 0);
+  optparser_release_batch(&item, 1);
+}
+
+static void test_no_arena(void) {
+  Option opt = {.lname = "number", .sname = 'i', .type = OPTION_APPEND_INT};
+  OptIntList numbers = {0};
+  opt.dest = &numbers;
+  OptionList list;
+  OPTLIST_INIT(list, opt);
+
+  char prog[] = "prog";
+  char i[] = "-i";
+  char one[] = "1";
+  char* argv[] = {prog, i, one, NULL};
+  OptParserError err = {0};
+  CHECK(parse_opts(&list, 3, argv, &err) == -1);
+  CHECK(err.type == OPTERROR_NO_ARENA);
+}
+
+static void test_missing_converter(void) {
+  OptLazy lazy;
+  Option opt = {.lname = "lazy", .type = OPTION_LAZY, .dest = &lazy};
+  OptionList list;
+  OPTLIST_INIT(list, opt);
+  OptParser parser;
+  uint64_t data[16];
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == -2);
+
+  opt.type = OPTION_CALLBACK;
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == -2);
+
+  char prog[] = "prog";
+  char value[] = "--lazy=1";
+  char* argv[] = {prog, value, NULL};
+  OptParserError err = {0};
+  CHECK(parse_opts(&list, 2, argv, &err) == -1);
+  CHECK(err.type == OPTERROR_NO_CONVERTER);
+}
+
+/* doubles use '.' in any locale, on both the fast path and through strtod;
+ * the locale part is skipped where no such locale is installed */
+static void test_double_locale(void) {
+  double value = 0;
+  Option opt = {.lname = "value", .sname = 'v', .type = OPTION_STORE_DOUBLE, .dest = &value};
+  OptionList list;
+  OPTLIST_INIT(list, opt);
+
+  char const* const locales[] = {"C", "de_DE.UTF-8", "fr_FR.UTF-8", "ru_RU.UTF-8"};
+  for (size_t i = 0; i < sizeof(locales) / sizeof(*locales); ++i) {
+    if (!setlocale(LC_NUMERIC, locales[i]))
+      continue;
+    char prog[] = "prog";
+    char fast[] = "--value=2.5";
+    char slow[] = "--value=0.1000000000000000000000001";
+    char comma[] = "--value=2,5";
+    OptParserError err = {0};
+    char* argv[] = {prog, fast, NULL};
+    CHECK(parse_opts(&list, 2, argv, &err) == 0 && value == 2.5);
+    argv[1] = slow;
+    CHECK(parse_opts(&list, 2, argv, &err) == 0 && value == 0.1);
+    argv[1] = comma;
+    CHECK(parse_opts(&list, 2, argv, &err) == -1 && err.type == OPTERROR_DOUBLE_TYPE_ERROR);
+  }
+  setlocale(LC_NUMERIC, "C");
+}
+
+/* integers take hex and size suffixes, and the type limits are exact */
+static void test_numbers(void) {
+  OptParserError err = {0};
+  long number = 0;
+  CHECK(parse_value(OPTION_STORE_INT, "0x1F", &number, &err) == 0 && number == 31);
+  CHECK(parse_value(OPTION_STORE_INT, "-0x10", &number, &err) == 0 && number == -16);
+  CHECK(parse_value(OPTION_STORE_INT, "9223372036854775807", &number, &err) == 0 && number == LONG_MAX);
+  CHECK(parse_value(OPTION_STORE_INT, "-9223372036854775808", &number, &err) == 0 && number == LONG_MIN);
+  CHECK(parse_value(OPTION_STORE_INT, "9223372036854775808", &number, &err) == -1 &&
+        err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_INT, "-9223372036854775809", &number, &err) == -1 &&
+        err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_INT, "0x", &number, &err) == -1 && err.type == OPTERROR_INT_TYPE_ERROR);
+  CHECK(parse_value(OPTION_STORE_INT, "12a", &number, &err) == -1 && err.type == OPTERROR_INT_TYPE_ERROR);
+
+  unsigned long unsigned_number = 0;
+  CHECK(parse_value(OPTION_STORE_UINT, "18446744073709551615", &unsigned_number, &err) == 0 &&
+        unsigned_number == ULONG_MAX);
+  CHECK(parse_value(OPTION_STORE_UINT, "0xFFFFFFFFFFFFFFFF", &unsigned_number, &err) == 0 &&
+        unsigned_number == ULONG_MAX);
+  CHECK(parse_value(OPTION_STORE_UINT, "18446744073709551616", &unsigned_number, &err) == -1 &&
+        err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_UINT, "-1", &unsigned_number, &err) == -1 && err.type == OPTERROR_UINT_TYPE_ERROR);
+
+  uint64_t size = 0;
+  CHECK(parse_value(OPTION_STORE_SIZE, "4k", &size, &err) == 0 && size == (uint64_t)4 << 10);
+  CHECK(parse_value(OPTION_STORE_SIZE, "2M", &size, &err) == 0 && size == (uint64_t)2 << 20);
+  CHECK(parse_value(OPTION_STORE_SIZE, "1g", &size, &err) == 0 && size == (uint64_t)1 << 30);
+  CHECK(parse_value(OPTION_STORE_SIZE, "0x10T", &size, &err) == 0 && size == (uint64_t)16 << 40);
+  CHECK(parse_value(OPTION_STORE_SIZE, "18446744073709551615", &size, &err) == 0 && size == UINT64_MAX);
+  CHECK(parse_value(OPTION_STORE_SIZE, "16777215T", &size, &err) == 0 && size == (uint64_t)16777215 << 40);
+  CHECK(parse_value(OPTION_STORE_SIZE, "16777216T", &size, &err) == -1 && err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_SIZE, "18446744073709551615k", &size, &err) == -1 &&
+        err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_SIZE, "4kb", &size, &err) == -1 && err.type == OPTERROR_SIZE_TYPE_ERROR);
+  CHECK(parse_value(OPTION_STORE_SIZE, "k", &size, &err) == -1 && err.type == OPTERROR_SIZE_TYPE_ERROR);
+}
+
+/* doubles read on the fast path and through strtod are the ones strtod reads */
+static void test_doubles(void) {
+  char const* const values[] = {
+      "2.5",   "-0.125", "1e10",      "123456.789",          "0.000001", ".5",
+      "1e22",  "1e23",   "1e300",     "12345678901234567890", "4.9e-324", "0.1000000000000000000000001",
+      "-1e-5", "7.",     "1.5E+3",
+  };
+  OptParserError err = {0};
+  for (size_t i = 0; i < sizeof(values) / sizeof(*values); ++i) {
+    double value = 0;
+    CHECK(parse_value(OPTION_STORE_DOUBLE, values[i], &value, &err) == 0 && value == strtod(values[i], NULL));
+  }
+
+  double value = 0;
+  CHECK(parse_value(OPTION_STORE_DOUBLE, "1e400", &value, &err) == -1 && err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_DOUBLE, "-1e400", &value, &err) == -1 && err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_DOUBLE, ".", &value, &err) == -1 && err.type == OPTERROR_DOUBLE_TYPE_ERROR);
+  CHECK(parse_value(OPTION_STORE_DOUBLE, "1e", &value, &err) == -1 && err.type == OPTERROR_DOUBLE_TYPE_ERROR);
+}
+
+/* list items are read eight digits at a time next to the commas, and errors
+ * report the column of the bad item */
+static void test_int_list(void) {
+  OptParserError err = {0};
+  OptIntList list = {0};
+  CHECK(parse_value(OPTION_STORE_INT_LIST, "12345678,1,123456789012,-5,+87654321,0", &list, &err) == 0);
+  long const expected[] = {12345678, 1, 123456789012, -5, 87654321, 0};
+  CHECK(list.count == sizeof(expected) / sizeof(*expected));
+  for (size_t i = 0; i < list.count && i < sizeof(expected) / sizeof(*expected); ++i)
+    CHECK(list.items[i] == expected[i]);
+
+  list = (OptIntList){0};
+  CHECK(parse_value(OPTION_STORE_INT_LIST, "-9223372036854775808,9223372036854775807", &list, &err) == 0);
+  CHECK(list.count == 2 && list.items[0] == LONG_MIN && list.items[1] == LONG_MAX);
+
+  list = (OptIntList){0};
+  CHECK(parse_value(OPTION_STORE_INT_LIST, "1,9223372036854775808", &list, &err) == -1);
+  CHECK(err.type == OPTERROR_OUT_OF_RANGE);
+  CHECK(parse_value(OPTION_STORE_INT_LIST, "1,2,x3", &list, &err) == -1);
+  CHECK(err.type == OPTERROR_INT_LIST_TYPE_ERROR && err.column == 5);
+  CHECK(parse_value(OPTION_STORE_INT_LIST, "12345678,123456x8", &list, &err) == -1);
+  CHECK(err.type == OPTERROR_INT_LIST_TYPE_ERROR && err.column == 16);
+  CHECK(parse_value(OPTION_STORE_INT_LIST, "1,,2", &list, &err) == -1);
+  CHECK(err.type == OPTERROR_INT_LIST_TYPE_ERROR && err.column == 3);
+}
+
+/* the masks of a generated parser are the ones `optparser_compile` builds,
+ * and options without a short name leave slot 0 empty */
+static void test_optspec_masks(void) {
+  static Option opts[spec_parser_N_OPTIONS];
+  memcpy(opts, spec_parser_options, sizeof(opts));
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < spec_parser_N_OPTIONS; ++i)
+    OPTLIST_ADD(list, opts[i]);
+  static OptParser parser;
+  static uint64_t data[512];
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+
+  size_t const words = (spec_parser_N_OPTIONS + 63) / 64;
+  CHECK(spec_parser.required && spec_parser.envs);
+  CHECK(!spec_parser.shorts[0] && spec_parser.shorts['r'] == &spec_parser_options[SPEC_REQ]);
+  CHECK(memcmp(spec_parser.required, parser.required, words * sizeof(*parser.required)) == 0);
+  CHECK(memcmp(spec_parser.envs, parser.envs, words * sizeof(*parser.envs)) == 0);
+  CHECK(spec_parser.required[SPEC_REQ / 64] == (uint64_t)1 << SPEC_REQ % 64);
+
+  SpecArgs args = {0};
+  OptParseState state;
+  optparse_state_init(&state, &args);
+  char prog[] = "prog";
+  char path[] = "P";
+  char* argv[] = {prog, path, NULL};
+  OptParserError err = {0};
+  setenv("OPTPARSE_TEST_ENV", "E", 1);
+  CHECK(optparser_parse(&spec_parser, &state, 2, argv, &err) == -1);
+  CHECK(err.type == OPTERROR_REQUIRED_OPTION);
+  CHECK_STR(err.lname, "req");
+  CHECK_STR(args.env, "E");
+  unsetenv("OPTPARSE_TEST_ENV");
+  optparse_state_release(&state);
+}
+
+/* lists past OPT_MAX_OPTIONS parse through `parse_opts`, compiled parsers
+ * need the activated bits of the state to be set */
+static void test_many_options(void) {
+  enum { N = OPT_MAX_OPTIONS + 100 };
+  static Option opts[N];
+  static bool flags[N];
+  static char names[N][8];
+  OptionList list;
+  for (size_t i = 0; i < N; ++i) {
+    snprintf(names[i], sizeof(names[i]), "o%u", (unsigned)i);
+    opts[i] = (Option){.lname = names[i], .type = OPTION_FLAG, .dest = &flags[i]};
+  }
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < N; ++i)
+    OPTLIST_ADD(list, opts[i]);
+
+  char prog[] = "prog";
+  char last[16];
+  snprintf(last, sizeof(last), "--o%u", (unsigned)N - 1);
+  char* argv[] = {prog, last, NULL};
+  OptParserError err = {0};
+  CHECK(parse_opts(&list, 2, argv, &err) == 0 && flags[N - 1]);
+
+  size_t const size = optparser_size(&list);
+  char* data = malloc(size + 1);
+  OptParser parser;
+  CHECK(optparser_compile(&parser, &list, data, size - 8) == -1);
+  CHECK(optparser_compile(&parser, &list, data + 1, size) == 0);
+
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  flags[N - 1] = false;
+  CHECK(optparser_parse(&parser, &state, 2, argv, &err) == -1);
+  CHECK(err.type == OPTERROR_TOO_MANY_OPTIONS);
+  uint64_t bits[(N + 63) / 64];
+  optparse_state_bits(&state, bits, sizeof(bits) / sizeof(*bits));
+  CHECK(optparser_parse(&parser, &state, 2, argv, &err) == 0 && flags[N - 1]);
+  optparse_state_release(&state);
+  free(data);
+}
+
+/* a positional first in the list takes the last position, and parsing does
+ * not write the options */
+static void test_option_positions(void) {
+  Args args = {0};
+  Option opts[] = {
+      {.lname = "path", .type = OPTION_POSITIONAL, .offset = offsetof(Args, path)},
+      {.lname = "flag", .sname = 'f', .type = OPTION_FLAG, .required = true, .offset = offsetof(Args, flag)},
+      {.lname = "str", .sname = 's', .type = OPTION_STORE_STR, .offset = offsetof(Args, str)},
+  };
+  Option copy[3];
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  OPTLIST_ADD(list, opts[1]);
+  OPTLIST_ADD(list, opts[2]);
+  memcpy(copy, opts, sizeof(opts));
+  OptParser parser;
+  uint64_t data[32];
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+  CHECK(parser.order[2] == &opts[0] && !parser.table);
+
+  OptParseState state;
+  optparse_state_init(&state, &args);
+  char prog[] = "prog";
+  char str[] = "-sS";
+  char path[] = "P";
+  char* argv[] = {prog, str, path, NULL};
+  OptParserError err = {0};
+  CHECK(optparser_parse(&parser, &state, 3, argv, &err) == -1);
+  CHECK(err.type == OPTERROR_REQUIRED_OPTION && err.sname == 'f');
+  char flag[] = "-f";
+  char* argv2[] = {prog, flag, str, path, NULL};
+  CHECK(optparser_parse(&parser, &state, 4, argv2, &err) == 0);
+  CHECK(args.flag && args.str && args.path);
+  CHECK(memcmp(copy, opts, sizeof(opts)) == 0);
+  optparse_state_release(&state);
+}
+
+/* the iterator stops at the end of the tokens and stays there */
+static void test_iter_argv(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  char prog[] = "prog";
+  char flag[] = "-fsX";
+  char path[] = "P";
+  char* argv[] = {prog, flag, path, NULL};
+  OptArgvSource src = {3, argv, 1};
+  OptIter iter;
+  optiter_init(&iter, &fx.parser, &fx.state, opt_argv_source, &src);
+
+  OptMatch match;
+  CHECK(opt_next(&iter, &match, &fx.err) == 1 && match.opt == &fx.opts[0]);
+  CHECK(opt_next(&iter, &match, &fx.err) == 1 && match.opt == &fx.opts[1]);
+  CHECK_STR(match.value, "X");
+  CHECK(opt_next(&iter, &match, &fx.err) == 1 && match.opt == &fx.opts[4]);
+  CHECK(opt_next(&iter, &match, &fx.err) == 0);
+  CHECK(opt_next(&iter, &match, &fx.err) == 0);
+  CHECK(fx.args.flag && fx.args.str && fx.args.path);
+  optparse_state_release(&fx.state);
+}
+
+/* a token longer than the buffer is an error ending the iteration, not the
+ * end of the stream */
+static void test_iter_nul_stream(void) {
+  static char data[] = "-f\0--str=much-too-long\0P";
+  Fixture fx;
+  fixture_init(&fx, 0);
+  FILE* fin = fmemopen(data, sizeof(data) - 1, "r");
+  char buf[8];
+  OptNulStream stream = {fin, buf, sizeof(buf), false};
+  OptIter iter;
+  optiter_init(&iter, &fx.parser, &fx.state, opt_nul_stream_source, &stream);
+
+  OptMatch match;
+  CHECK(opt_next(&iter, &match, &fx.err) == 1 && match.opt == &fx.opts[0]);
+  CHECK(opt_next(&iter, &match, &fx.err) == -1 && fx.err.type == OPTERROR_TOKEN_SOURCE);
+  CHECK(stream.overflow);
+  CHECK(opt_next(&iter, &match, &fx.err) == 0);
+  /* the stream is past the long token */
+  char const* next = opt_nul_stream_source(&stream);
+  CHECK_STR(next, "P");
+  CHECK(opt_nul_stream_source(&stream) == NULL);
+  fclose(fin);
+
+  fin = fmemopen(data, sizeof(data) - 1, "r");
+  stream = (OptNulStream){fin, buf, 0, false};
+  CHECK(opt_nul_stream_source(&stream) == opt_source_error && stream.overflow);
+  fclose(fin);
+  optparse_state_release(&fx.state);
+}
+
+static void print_all_help(OptParser const* parser, char* out, size_t size) {
+  FILE* fout = fmemopen(out, size, "w");
+  optparser_print_usage(parser, fout, "prog");
+  optparser_print_help(parser, fout);
+  optparser_print_help_group(parser, "io", fout);
+  optparser_print_help_prefix(parser, "s", fout);
+  fclose(fout);
+}
+
+/* the cache prints the text rendered without it */
+static void test_help_cache(void) {
+  Fixture fx;
+  fixture_init(&fx, 0);
+  fx.opts[0].help = "a flag";
+  fx.opts[1].help = "a string with a long name column";
+  fx.opts[1].metavar = "VERY_LONG_METAVAR";
+  fx.opts[1].group = "io";
+  fx.opts[2].help = "a value";
+  fx.opts[2].group = "io";
+  fx.opts[4].help = "a path";
+
+  char uncached[1024] = {0};
+  print_all_help(&fx.parser, uncached, sizeof(uncached));
+  CHECK(strstr(uncached, "a string with a long name column"));
+
+  uint16_t widths[5];
+  OptHelpCache cache = {.widths = widths};
+  char text[1024];
+  CHECK(opthelp_build(&cache, &fx.parser, text, 8) == -1);
+  CHECK(opthelp_size(&fx.parser) <= sizeof(text));
+  CHECK(opthelp_build(&cache, &fx.parser, text, sizeof(text)) == 0);
+  fx.parser.help_cache = &cache;
+  char cached[1024] = {0};
+  print_all_help(&fx.parser, cached, sizeof(cached));
+  CHECK(strcmp(cached, uncached) == 0);
+
+  /* widths alone align group and prefix entries */
+  OptHelpCache measured = {.widths = widths};
+  opthelp_measure(&measured, &fx.parser);
+  fx.parser.help_cache = &measured;
+  print_all_help(&fx.parser, cached, sizeof(cached));
+  CHECK(strcmp(cached, uncached) == 0);
+}
+
+/* group and prefix help print only the matching options, prefix help in name
+ * order with a sorted index */
+static void test_help_filters(void) {
+  char const* const names[] = {"input", "size", "output", "socket", "silent"};
+  char const* const groups[] = {"io", NULL, "io", "net", NULL};
+  enum { N = sizeof(names) / sizeof(*names) };
+  Option opts[N];
+  bool flags[N];
+  for (size_t i = 0; i < N; ++i)
+    opts[i] = (Option){.lname = names[i], .help = "help", .type = OPTION_FLAG, .dest = &flags[i], .group = groups[i]};
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < N; ++i)
+    OPTLIST_ADD(list, opts[i]);
+  uint64_t data[64];
+  OptParser parser;
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+
+  char out[512];
+  FILE* fout = fmemopen(out, sizeof(out), "w");
+  optparser_print_help_group(&parser, "io", fout);
+  fclose(fout);
+  CHECK(strstr(out, "--input") && strstr(out, "--output"));
+  CHECK(!strstr(out, "--size") && !strstr(out, "--socket") && !strstr(out, "--silent"));
+
+  fout = fmemopen(out, sizeof(out), "w");
+  optparser_print_help_group(&parser, NULL, fout);
+  fclose(fout);
+  CHECK(strstr(out, "--size") && strstr(out, "--silent"));
+  CHECK(!strstr(out, "--input") && !strstr(out, "--output") && !strstr(out, "--socket"));
+
+  fout = fmemopen(out, sizeof(out), "w");
+  optparser_print_help_prefix(&parser, "s", fout);
+  fclose(fout);
+  char const* size = strstr(out, "--size");
+  char const* socket = strstr(out, "--socket");
+  char const* silent = strstr(out, "--silent");
+  CHECK(!strstr(out, "--input") && !strstr(out, "--output"));
+  CHECK(size && socket && silent && size < socket && socket < silent);
+
+  Option const* sorted[N];
+  OptIndex index = {0};
+  CHECK(optindex_build_sorted(&index, &parser, sorted, N) == 0);
+  parser.index = &index;
+  fout = fmemopen(out, sizeof(out), "w");
+  optparser_print_help_prefix(&parser, "s", fout);
+  fclose(fout);
+  size = strstr(out, "--size");
+  socket = strstr(out, "--socket");
+  silent = strstr(out, "--silent");
+  CHECK(!strstr(out, "--input") && !strstr(out, "--output"));
+  CHECK(size && socket && silent && silent < size && size < socket);
+
+  out[0] = '\0';
+  fout = fmemopen(out, sizeof(out), "w");
+  optparser_print_help_prefix(&parser, "x", fout);
+  optparser_print_help_group(&parser, "none", fout);
+  fclose(fout);
+  CHECK(out[0] == '\0');
+}
+
+/* keyed, scanned, hashed and sorted lookups find the same options and give
+ * the same suggestions */
+static void test_lookup_paths(void) {
+  enum { N = 300 };
+  static Option opts[N];
+  static bool flags[N];
+  static char names[N][16];
+  OptionList list;
+  for (size_t i = 0; i < N; ++i) {
+    snprintf(names[i], sizeof(names[i]), "opt-%u", (unsigned)i);
+    opts[i] = (Option){.lname = names[i], .type = OPTION_FLAG, .dest = &flags[i]};
+  }
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < N; ++i)
+    OPTLIST_ADD(list, opts[i]);
+  static uint64_t data[4096];
+  OptParser keyed;
+  CHECK(optparser_compile(&keyed, &list, data, sizeof(data)) == 0);
+  CHECK(keyed.keys && keyed.n_keys == N);
+
+  OptParser scanned = keyed;
+  scanned.keys = NULL;
+  scanned.by_length = NULL;
+  static OptIndexSlot slots[512];
+  OptIndex hashed_index;
+  CHECK(optindex_build_parser(&hashed_index, &keyed, slots, 512) == 0);
+  OptParser hashed = scanned;
+  hashed.index = &hashed_index;
+  static Option const* sorted[N];
+  OptIndex sorted_index = {0};
+  CHECK(optindex_build_sorted(&sorted_index, &keyed, sorted, N) == 0);
+  OptParser by_sort = scanned;
+  by_sort.index = &sorted_index;
+  OptParser const* parsers[] = {&keyed, &scanned, &hashed, &by_sort};
+
+  char prog[] = "prog";
+  char arg[32];
+  char* argv[] = {prog, arg, NULL};
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  for (size_t p = 0; p < sizeof(parsers) / sizeof(*parsers); ++p) {
+    for (size_t i = 0; i < N; i += 7) {
+      memset(flags, 0, sizeof(flags));
+      snprintf(arg, sizeof(arg), "--opt-%u", (unsigned)i);
+      OptParserError err = {0};
+      CHECK(optparser_parse(parsers[p], &state, 2, argv, &err) == 0 && flags[i]);
+    }
+    snprintf(arg, sizeof(arg), "--opt-2x99");
+    OptParserError err = {0};
+    CHECK(optparser_parse(parsers[p], &state, 2, argv, &err) == -1 && err.type == OPTERROR_UNKNOWN);
+    CHECK_STR(err.suggestion, "opt-299");
+  }
+  optparse_state_release(&state);
+}
+
+/* the short table maps every byte, a high one included, to the first option
+ * with that short name */
+static void test_short_table(void) {
+  bool flags[3] = {false};
+  Option opts[] = {
+      {.sname = 'a', .type = OPTION_FLAG, .dest = &flags[0]},
+      {.sname = (char)0xe9, .type = OPTION_FLAG, .dest = &flags[1]},
+      {.sname = 'a', .type = OPTION_FLAG, .dest = &flags[2]},
+  };
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < sizeof(opts) / sizeof(*opts); ++i)
+    OPTLIST_ADD(list, opts[i]);
+  uint64_t data[32];
+  OptParser parser;
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+  CHECK(parser.shorts['a'] == &opts[0] && parser.shorts[0xe9] == &opts[1]);
+  CHECK(!parser.shorts[0] && !parser.shorts['b'] && !parser.shorts[0xff]);
+
+  char prog[] = "prog";
+  char group[] = "-\xe9" "a";
+  char unknown[] = "-b";
+  char* argv[] = {prog, group, NULL};
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  OptParserError err = {0};
+  CHECK(optparser_parse(&parser, &state, 2, argv, &err) == 0 && flags[0] && flags[1] && !flags[2]);
+  argv[1] = unknown;
+  CHECK(optparser_parse(&parser, &state, 2, argv, &err) == -1 && err.type == OPTERROR_UNKNOWN);
+  optparse_state_release(&state);
+}
+
+/* a unique prefix names its option and a shared one is ambiguous, the same
+ * with a linear scan and with a sorted index */
+static void test_abbreviations(void) {
+  char const* const names[] = {"verbose", "version", "value", "out", "output", "out-dir"};
+  enum { N = sizeof(names) / sizeof(*names) };
+  Option opts[N];
+  bool flags[N];
+  for (size_t i = 0; i < N; ++i)
+    opts[i] = (Option){.lname = names[i], .type = OPTION_FLAG, .dest = &flags[i]};
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < N; ++i)
+    OPTLIST_ADD(list, opts[i]);
+  uint64_t data[64];
+  OptParser linear;
+  CHECK(optparser_compile(&linear, &list, data, sizeof(data)) == 0);
+  linear.flags = OPTPARSER_ABBREVIATIONS;
+  Option const* sorted[N];
+  OptIndex index = {0};
+  CHECK(optindex_build_sorted(&index, &linear, sorted, N) == 0);
+  OptParser by_sort = linear;
+  by_sort.index = &index;
+  OptParser exact = linear;
+  exact.flags = 0;
+
+  struct {
+    char const* arg;
+    int match;
+  } const cases[] = {
+      {"--verb", 0},  {"--vers", 1},  {"--va", 2},   {"--out", 3}, {"--outp", 4},
+      {"--out-", 5},  {"--ver", -1},  {"--v", -1},   {"--ou", -1}, {"--x", -2},
+      {"--verbosex", -2},
+  };
+  char prog[] = "prog";
+  char arg[32];
+  char* argv[] = {prog, arg, NULL};
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  OptParser const* parsers[] = {&linear, &by_sort};
+  for (size_t p = 0; p < sizeof(parsers) / sizeof(*parsers); ++p) {
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i) {
+      memset(flags, 0, sizeof(flags));
+      snprintf(arg, sizeof(arg), "%s", cases[i].arg);
+      OptParserError err = {0};
+      int const ret = optparser_parse(parsers[p], &state, 2, argv, &err);
+      if (cases[i].match >= 0)
+        CHECK(ret == 0 && flags[cases[i].match]);
+      else
+        CHECK(ret == -1 && err.type == (cases[i].match == -1 ? OPTERROR_AMBIGUOUS : OPTERROR_UNKNOWN));
+    }
+  }
+
+  /* without the flag only exact names match */
+  snprintf(arg, sizeof(arg), "--verb");
+  OptParserError err = {0};
+  CHECK(optparser_parse(&exact, &state, 2, argv, &err) == -1 && err.type == OPTERROR_UNKNOWN);
+  snprintf(arg, sizeof(arg), "--out");
+  memset(flags, 0, sizeof(flags));
+  CHECK(optparser_parse(&exact, &state, 2, argv, &err) == 0 && flags[3]);
+  optparse_state_release(&state);
+}
+
+/* an unknown name suggests the closest one, counting an adjacent swap as a
+ * single edit, and nothing past the distance bound of its length; the same
+ * with and without the length buckets */
+static void test_suggestions(void) {
+  char const* const names[] = {"verbose", "output", "color", "config", "size"};
+  enum { N = sizeof(names) / sizeof(*names) };
+  Option opts[N];
+  bool flags[N];
+  for (size_t i = 0; i < N; ++i)
+    opts[i] = (Option){.lname = names[i], .type = OPTION_FLAG, .dest = &flags[i]};
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < N; ++i)
+    OPTLIST_ADD(list, opts[i]);
+  uint64_t data[64];
+  OptParser bucketed;
+  CHECK(optparser_compile(&bucketed, &list, data, sizeof(data)) == 0);
+  CHECK(bucketed.by_length);
+  OptParser scanned = bucketed;
+  scanned.by_length = NULL;
+
+  struct {
+    char const* arg;
+    char const* suggestion;
+  } const cases[] = {
+      {"--verobse", "verbose"}, /* swap */
+      {"--vrebose", "verbose"}, /* swap */
+      {"--outptu", "output"},   /* swap at the end */
+      {"--cnofig", "config"},   /* swap */
+      {"--colour", "color"},    /* insertion */
+      {"--colir", "color"},     /* closer than config */
+      {"--verbxsx", "verbose"}, /* two edits */
+      {"--vxrbxsx", NULL},      /* three edits */
+      {"--siz", "size"},        /* one edit of three bytes */
+      {"--sz", NULL},           /* two edits of two bytes */
+      {"--zzzzzz", NULL},
+  };
+  char prog[] = "prog";
+  char arg[32];
+  char* argv[] = {prog, arg, NULL};
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  OptParser const* parsers[] = {&bucketed, &scanned};
+  for (size_t p = 0; p < sizeof(parsers) / sizeof(*parsers); ++p) {
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); ++i) {
+      snprintf(arg, sizeof(arg), "%s", cases[i].arg);
+      OptParserError err = {0};
+      CHECK(optparser_parse(parsers[p], &state, 2, argv, &err) == -1 && err.type == OPTERROR_UNKNOWN);
+      if (cases[i].suggestion)
+        CHECK_STR(err.suggestion, cases[i].suggestion);
+      else
+        CHECK(!err.suggestion);
+    }
+  }
+  optparse_state_release(&state);
+}
+
+/* collect mode reports argument, environment and config errors in parse
+ * order, counts errors past the capacity and ends with a fatal error */
+static void test_collect_errors(void) {
+  long count = 0;
+  long level = 0;
+  char const* config = NULL;
+  Option opts[] = {
+      {.lname = "count", .type = OPTION_STORE_INT, .env = "OPTPARSE_TEST_COUNT", .dest = &count},
+      {.lname = "level", .type = OPTION_STORE_INT, .dest = &level},
+      {.lname = "config", .type = OPTION_CONFIG, .dest = &config},
+  };
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  OPTLIST_ADD(list, opts[1]);
+  OPTLIST_ADD(list, opts[2]);
+  OptParser parser;
+  uint64_t data[32];
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+
+  char path[ARG_LEN];
+  CHECK(write_temp(path, "level = x\nbogus = 1\n"));
+  char prog[] = "prog";
+  char config_arg[] = "--config";
+  char nope[] = "--nope";
+  char* argv[] = {prog, config_arg, path, nope, NULL};
+  setenv("OPTPARSE_TEST_COUNT", "y", 1);
+
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  OptParserError errors[4];
+  optparse_state_errors(&state, errors, 4);
+  OptParserError err = {0};
+  CHECK(optparser_parse(&parser, &state, 4, argv, &err) == -1);
+  CHECK(state.n_errors == 4);
+  CHECK(errors[0].type == OPTERROR_UNKNOWN && errors[0].index == 3);
+  CHECK(errors[1].type == OPTERROR_INT_TYPE_ERROR && errors[1].index == 0);
+  CHECK_STR(errors[1].opt, "OPTPARSE_TEST_COUNT");
+  CHECK(errors[2].type == OPTERROR_INT_TYPE_ERROR && errors[2].line == 1);
+  CHECK(errors[3].type == OPTERROR_UNKNOWN && errors[3].line == 2);
+  CHECK(err.type == OPTERROR_UNKNOWN && err.index == 3);
+
+  /* errors past the capacity are only counted */
+  optparse_state_errors(&state, errors, 2);
+  CHECK(optparser_parse(&parser, &state, 4, argv, &err) == -1);
+  CHECK(state.n_errors == 4);
+  CHECK(errors[1].type == OPTERROR_INT_TYPE_ERROR && errors[1].index == 0);
+
+  /* a fatal error ends the parse and is the last error */
+  parser.flags = OPTPARSER_RESPONSE_FILES;
+  char missing[] = "@/nonexistent/optparse_test";
+  char* fatal_argv[] = {prog, nope, missing, nope, NULL};
+  unsetenv("OPTPARSE_TEST_COUNT");
+  optparse_state_errors(&state, errors, 4);
+  CHECK(optparser_parse(&parser, &state, 4, fatal_argv, &err) == -1);
+  CHECK(state.n_errors == 2);
+  CHECK(errors[0].type == OPTERROR_UNKNOWN && errors[0].index == 1);
+  CHECK(errors[1].type == OPTERROR_RESPONSE_FILE && errors[1].index == 2);
+  CHECK(err.type == OPTERROR_UNKNOWN);
+  optparse_state_release(&state);
+  unlink(path);
+}
+
+typedef struct {
+  bool flag;
+  OptStrList names;
+  OptIntList numbers;
+  char const* path;
+} SnapArgs;
+
+/* Offsets of a snapshot of the test_snapshot arguments: the header, a word of
+ * activated bits, then the flag, name and number records */
+enum {
+  SNAP_HASH = 8,
+  SNAP_FLAG = 48 + 8 + 8,
+  SNAP_NAMES = SNAP_FLAG + 1 + 8,
+  SNAP_NUMBERS = SNAP_NAMES + 8 + 5 + 8,
+};
+
+static int load_corrupt(OptParser const* parser, OptParseState* state, uint64_t const* snapshot, size_t size,
+                        size_t header_size, size_t offset, int byte, uint64_t word, OptParserError* err) {
+  static uint64_t copy[64];
+  memcpy(copy, snapshot, size);
+  memcpy((char*)copy + 16, &(uint64_t){header_size}, sizeof(uint64_t));
+  if (byte >= 0)
+    ((unsigned char*)copy)[offset] = (unsigned char)byte;
+  else
+    memcpy((char*)copy + offset, &word, sizeof(word));
+  return optsnapshot_load(parser, state, copy, size, err);
+}
+
+/* a snapshot restores the parse, and corrupt or truncated snapshots are
+ * rejected before anything is allocated for them */
+static void test_snapshot(void) {
+  Option opts[] = {
+      {.lname = "flag", .sname = 'f', .type = OPTION_FLAG, .offset = offsetof(SnapArgs, flag)},
+      {.lname = "name", .sname = 'n', .type = OPTION_APPEND_STR, .offset = offsetof(SnapArgs, names)},
+      {.lname = "number", .sname = 'i', .type = OPTION_APPEND_INT, .offset = offsetof(SnapArgs, numbers)},
+      {.lname = "path", .type = OPTION_POSITIONAL, .offset = offsetof(SnapArgs, path)},
+  };
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < sizeof(opts) / sizeof(*opts); ++i)
+    OPTLIST_ADD(list, opts[i]);
+  OptParser parser;
+  uint64_t data[32];
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+
+  char prog[] = "prog";
+  char flag[] = "-f";
+  char name_a[] = "-nA";
+  char name_bc[] = "-nBC";
+  char one[] = "-i1";
+  char two[] = "-i2";
+  char path[] = "P";
+  char* argv[] = {prog, flag, name_a, name_bc, one, two, path, NULL};
+  static long arena[64];
+  SnapArgs args = {0};
+  OptParseState state;
+  optparse_state_init(&state, &args);
+  optparse_state_arena(&state, arena, sizeof(arena));
+  OptParserError err = {0};
+  CHECK(optparser_parse(&parser, &state, 7, argv, &err) == 0);
+
+  uint64_t snapshot[64];
+  size_t const size = optsnapshot_size(&parser, &state);
+  CHECK(size == SNAP_NUMBERS + 8 + 16 + 8 + 2 && size <= sizeof(snapshot));
+  CHECK(optsnapshot_save(&parser, &state, snapshot, size) == 0);
+
+  SnapArgs loaded = {0};
+  static long loaded_arena[64];
+  OptParseState loaded_state;
+  optparse_state_init(&loaded_state, &loaded);
+  optparse_state_arena(&loaded_state, loaded_arena, sizeof(loaded_arena));
+  CHECK(optsnapshot_load(&parser, &loaded_state, snapshot, size, &err) == 0);
+  CHECK(loaded.flag && loaded.names.count == 2 && loaded.numbers.count == 2);
+  CHECK_STR(loaded.names.items[0], "A");
+  CHECK_STR(loaded.names.items[1], "BC");
+  CHECK(loaded.numbers.items[0] == 1 && loaded.numbers.items[1] == 2);
+  CHECK_STR(loaded.path, "P");
+  CHECK(loaded_state.pos_count == 1 && loaded_state.tail == 7);
+
+  struct {
+    size_t size;
+    size_t header_size;
+    size_t offset;
+    int byte;
+    uint64_t word;
+  } const corrupt[] = {
+      {size, size, SNAP_HASH, 0xee, 0},                   /* another spec */
+      {size - 1, size, SNAP_FLAG, 1, 0},                  /* truncated */
+      {size - 1, size - 1, SNAP_FLAG, 1, 0},              /* cut in the last record */
+      {size + 1, size, SNAP_FLAG, 1, 0},                  /* trailing byte */
+      {size + 1, size + 1, SNAP_FLAG, 1, 0},              /* recorded trailing byte */
+      {size, size, SNAP_FLAG, 2, 0},                      /* not a bool */
+      {size, size, SNAP_NAMES, -1, (uint64_t)1 << 40},    /* names past the record */
+      {size, size, SNAP_NAMES, -1, 6},                    /* more names than strings */
+      {size, size, SNAP_NUMBERS, -1, (uint64_t)1 << 40},  /* numbers past the record */
+  };
+  for (size_t i = 0; i < sizeof(corrupt) / sizeof(*corrupt); ++i) {
+    loaded = (SnapArgs){0};
+    err = (OptParserError){0};
+    CHECK(load_corrupt(&parser, &loaded_state, snapshot, corrupt[i].size, corrupt[i].header_size, corrupt[i].offset,
+                       corrupt[i].byte, corrupt[i].word, &err) == -1);
+    /* an oversized count would fill the arena if it was reserved */
+    CHECK(err.type == OPTERROR_SNAPSHOT);
+  }
+  /* the state is usable after a rejected snapshot */
+  CHECK(optsnapshot_load(&parser, &loaded_state, snapshot, size, &err) == 0 && loaded.flag);
+  optparse_state_release(&loaded_state);
+  optparse_state_release(&state);
+}
+
+#if defined(OPT_STATS)
+static void count_stats(OptStats const* stats, void* ctx) {
+  OptStats* total = ctx;
+  total->tokens += stats->tokens;
+  total->lookups += stats->lookups;
+  total->conversions += stats->conversions;
+}
+
+/* a parse counts its option tokens, lookups and converted numbers, and
+ * reports them to the hook */
+static void test_stats(void) {
+  bool flag = false;
+  long number = 0;
+  OptIntList items = {0};
+  Option opts[] = {
+      {.lname = "flag", .sname = 'f', .type = OPTION_FLAG, .dest = &flag},
+      {.lname = "number", .sname = 'n', .type = OPTION_STORE_INT, .dest = &number},
+      {.lname = "list", .type = OPTION_STORE_INT_LIST, .dest = &items},
+  };
+  OptionList list;
+  OPTLIST_INIT(list, opts[0]);
+  for (size_t i = 1; i < sizeof(opts) / sizeof(*opts); ++i)
+    OPTLIST_ADD(list, opts[i]);
+  OptParser parser;
+  uint64_t data[32];
+  CHECK(optparser_compile(&parser, &list, data, sizeof(data)) == 0);
+
+  char prog[] = "prog";
+  char flag_arg[] = "-f";
+  char number_arg[] = "-n";
+  char five[] = "5";
+  char list_arg[] = "--list=1,2,3";
+  char* argv[] = {prog, flag_arg, number_arg, five, list_arg, NULL};
+  static long arena[16];
+  OptParseState state;
+  optparse_state_init(&state, NULL);
+  optparse_state_arena(&state, arena, sizeof(arena));
+  OptStats total = {0};
+  optparse_stats_hook(count_stats, &total);
+  OptParserError err = {0};
+  CHECK(optparser_parse(&parser, &state, 5, argv, &err) == 0);
+  optparse_stats_hook(NULL, NULL);
+
+  CHECK(state.stats.tokens == 3 && state.stats.lookups == 3 && state.stats.conversions == 4);
+  CHECK(state.stats.compile_ns == 0);
+  CHECK(total.tokens == 3 && total.lookups == 3 && total.conversions == 4);
+
+  /* the stats are those of the last parse */
+  CHECK(optparser_parse(&parser, &state, 2, argv, &err) == 0);
+  CHECK(state.stats.tokens == 1 && state.stats.conversions == 0 && total.tokens == 3);
+  optparse_state_release(&state);
+}
+#endif